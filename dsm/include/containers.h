@@ -0,0 +1,100 @@
+#ifndef _CONTAINERS_H_
+#define _CONTAINERS_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
+
+// Containers over a shared region. Both lay their data out on coherence-page
+// boundaries and start out as the region's zero pages, so every node builds
+// its own handle over the same addresses without writing anything.
+
+//
+// Hash table of 64-bit keys and values with open addressing. Each page is a
+// bucket group of DSMHT_SLOTS slots, and a key probes only within the group
+// it hashes to. Groups are handed out to nodes in contiguous chunks and only
+// a group's owner may write it, so inserts never move pages between nodes and
+// lookups keep read copies cached everywhere. Keys 0 and DSMHT_TOMBSTONE mark
+// free and deleted slots, and cannot be stored.
+//
+
+#define DSMHT_SLOTS (PG_SIZE / 16)
+#define DSMHT_TOMBSTONE UINT64_MAX
+
+// Return values of dsmht_put and dsmht_del.
+#define DSMHT_OK 0
+#define DSMHT_NOT_OWNER (-1)  // The key's group belongs to another node.
+#define DSMHT_FULL (-2)       // The key's group has no free slot.
+#define DSMHT_MISSING (-3)    // dsmht_del found no such key.
+#define DSMHT_BADKEY (-4)     // The key is 0 or DSMHT_TOMBSTONE.
+
+struct dsmht_slot {
+  uint64_t key;
+  uint64_t value;
+};
+
+struct dsmht_group {
+  struct dsmht_slot slots[DSMHT_SLOTS];
+};
+
+struct dsmht {
+  struct dsmht_group *groups;
+  size_t ngroups;
+  int nodes;
+  int id;
+  pthread_mutex_t lock;  // Serializes this node's writers.
+};
+
+// The table takes ngroups pages at base.
+int dsmht_init(struct dsmht *ht, void *base, size_t ngroups, int nodes, int id);
+
+// The node that may write key.
+int dsmht_owner(struct dsmht *ht, uint64_t key);
+
+int dsmht_put(struct dsmht *ht, uint64_t key, uint64_t value);
+
+// Return 1 and set *value if key is present, 0 if not (or if key is reserved).
+int dsmht_get(struct dsmht *ht, uint64_t key, uint64_t *value);
+
+int dsmht_del(struct dsmht *ht, uint64_t key);
+
+//
+// Vector of fixed-size elements, growing in place over the space it is given.
+// A header page holds the length and elements follow from the next page,
+// never straddling a page, so touching an element moves one page. Pages past
+// the length are never touched, so reserving room for the largest size the
+// vector may reach costs nothing until it gets there; it cannot grow past
+// that, since every node would have to map the new space. Only the owner node
+// appends; any node may read or overwrite elements below the length.
+//
+
+struct dsmvec_header {
+  uint64_t length;
+};
+
+struct dsmvec {
+  struct dsmvec_header *header;
+  char *data;
+  size_t elemsize;
+  size_t perpage;   // Elements per page.
+  size_t capacity;  // Elements that fit in the space given.
+  int owner;
+  int id;
+};
+
+// The vector takes len bytes at base, which must be page-aligned.
+int dsmvec_init(struct dsmvec *v, void *base, size_t len, size_t elemsize,
+                int owner, int id);
+
+size_t dsmvec_size(struct dsmvec *v);
+
+// Return the address of element i, or NULL if i is past the end.
+void *dsmvec_at(struct dsmvec *v, size_t i);
+
+// Append a copy of elem. Return its index, or -1 if this node is not the
+// owner or the vector is full.
+long dsmvec_push(struct dsmvec *v, const void *elem);
+
+#endif  // _CONTAINERS_H_
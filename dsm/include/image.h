@@ -0,0 +1,38 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared-region image written by the manager on dsm_checkpoint and read back
+// by warm-started nodes (initlibdsmuwarm; manager/dsmimage.py). An image is a
+// header, one entry per page, then the page contents in entry order starting
+// at the first page-aligned offset after the entries. All fields are
+// little-endian.
+
+#define IMAGE_MAGIC "DSMIMAGE"
+#define IMAGE_VERSION 1
+
+#define IMAGE_ZERO (1 << 0)  // The page was never written.
+
+#define IMAGE_MAX_NODES 64
+
+struct imageheader {
+  char magic[8];
+  uint32_t version;
+  uint32_t pagesize;
+  uint32_t npages;
+} __attribute__((packed));
+
+struct imageentry {
+  uint32_t pgnum;
+  uint32_t flags;
+  uint64_t holders;  // Bit n - 1 is set if node n held the page.
+} __attribute__((packed));
+
+static inline size_t imagedataoffset(uint32_t npages, size_t pagesize) {
+  size_t end = sizeof(struct imageheader) + npages * sizeof(struct imageentry);
+  return (end + pagesize - 1) / pagesize * pagesize;
+}
+
+#endif  // _IMAGE_H_
@@ -13,8 +13,22 @@
 //
 int initlibdsmu(char *ip, int port, uintptr_t starta, size_t len);
 
+// As initlibdsmu, then install the read copies this node held when image, a
+// file written by dsm_checkpoint, was taken. If image is NULL, this is
+// initlibdsmu without the DSM_WARM_START fallback.
+int initlibdsmuwarm(char *ip, int port, uintptr_t starta, size_t len,
+                    const char *image);
+
 int teardownlibdsmu(void);
 
+// Block until nodes nodes have entered the barrier.
+int dsm_barrier(int nodes);
+
+// Have the manager save all shared pages to an image at path. Nodes started
+// with initlibdsmuwarm or DSM_WARM_START=path against a manager restarted
+// from the image begin with their read copies in place.
+int dsm_checkpoint(const char *path);
+
 #define SHRPOL_NONE (0)
 #define SHRPOL_INIT_ZERO (1 << 0)
 
@@ -24,6 +38,21 @@ struct sharedregion {
   uintptr_t start;
   size_t len;
   uint16_t policy;
+  uintptr_t shadow;  // Read-write alias of the region, or 0.
 };
 
+void *shadowpage(void *pg);
+
+// Read leases on granted pages; see manager.py --lease-ms. Leases run from
+// when the page was asked for, on the monotonic clock (requestsent).
+void grantlease(int pgnum, int ms, uint64_t since_us);
+uint64_t requestsent(int pgnum);
+void cancellease(int pgnum);
+
+// Wake the faults waiting for a page that was just installed.
+void completefault(int pgnum);
+
+// Install the n pages of the pending warm start batch the manager accepted.
+void completewarmstart(int *pgnums, int n, int leasems);
+
 #endif  // _LIBDSMU_H_
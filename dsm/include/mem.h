@@ -4,7 +4,9 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#ifndef REG_ERR  // <sys/ucontext.h> defines it under _GNU_SOURCE.
 #define REG_ERR 19
+#endif
 #define PG_WRITE 0x2
 #define PG_PRESENT 0x1
 #define PG_BITS 12
@@ -0,0 +1,21 @@
+#ifndef _PAGECOMP_H_
+#define _PAGECOMP_H_
+
+#include <stddef.h>
+
+// Page compression for the wire. Shared pages mostly hold small integers, so
+// each 32-bit word is stored in 0, 1, 2 or 4 bytes, as chosen by a 2-bit tag.
+// A compressed page is the PAGECOMP_TAG_BYTES of tags followed by the words.
+// manager/pagecomp.py decodes the same format.
+
+#define PAGECOMP_TAG_BYTES 256
+
+// Compress the page at pg into out, which must hold PG_SIZE bytes.
+// Return the compressed length, or -1 if the page would not shrink.
+int compresspage(const void *pg, void *out);
+
+// Decompress len bytes at in into the page at pg.
+// Return 0 on success.
+int decompresspage(const void *in, size_t len, void *pg);
+
+#endif  // _PAGECOMP_H_
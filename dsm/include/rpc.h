@@ -1,8 +1,12 @@
 #ifndef _RPC_H_
 #define _RPC_H_
 
+#include <stddef.h>
+
 int sendman(char *str);
 
+int sendmandata(char *str, const void *data, size_t len);
+
 int initsocks(char *ip, int port);
 
 int teardownsocks(void);
@@ -11,14 +15,30 @@ void *listenman(void *ptr);
 
 void confirminvalidate(int pgnum);
 
-void confirminvalidate_encoded(int pgnum, char *pgb64);
+void confirminvalidate_page(int pgnum, void *pg);
 
 int invalidate(char *msg);
 
-int dispatch(char *msg);
+int invalidatebatch(char *msg);
+
+int dispatch(char *msg, void *data);
 
 int requestpage(int pgnum, char *type);
 
-int handleconfirm(char *msg);
+int requestpages(int *pgnums, int *writes, int n);
+
+int handleconfirm(char *msg, void *data);
+
+int requestbarrier(int nodes);
+
+int handlebarrier(char *msg);
+
+int requestcheckpoint(const char *path);
+
+int handlecheckpoint(char *msg);
+
+int requestwarmstart(int *pgnums, int n);
+
+int handlewarmstart(char *msg);
 
 #endif  // _RPC_H_
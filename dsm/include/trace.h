@@ -0,0 +1,43 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// Binary fault trace shared by libdsmu and the manager (manager/dsmtrace.py).
+// A trace file is a header followed by fixed-size little-endian records.
+
+#define TRACE_MAGIC "DSMTRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_READ 0
+#define TRACE_WRITE 1
+
+#define TRACE_SRC_NODE 0
+#define TRACE_SRC_MANAGER 1
+
+struct traceheader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recsize;
+} __attribute__((packed));
+
+struct tracerec {
+  uint64_t ts_us;       // When the fault started.
+  uint32_t pgnum;
+  uint32_t latency_us;  // Fault start until the page was usable.
+  uint16_t node;
+  uint8_t access;       // TRACE_READ or TRACE_WRITE.
+  uint8_t source;       // TRACE_SRC_NODE or TRACE_SRC_MANAGER.
+} __attribute__((packed));
+
+// Start recording faults of this node to the file at path.
+int inittrace(const char *path, int node);
+
+// Record one fault. Does nothing unless tracing was started.
+void tracefault(uintptr_t pgnum, int access, uint64_t start_us,
+                uint64_t end_us);
+
+// Flush buffered records and close the trace file.
+int teardowntrace(void);
+
+#endif  // _TRACE_H_
@@ -0,0 +1,62 @@
+# Reader and writer for the shared-region images the manager takes on
+# dsm_checkpoint. The layout matches include/image.h: a header, one entry per
+# page, then the page contents in entry order from the first page-aligned
+# offset after the entries.
+
+import collections
+import os
+import struct
+
+MAGIC = "DSMIMAGE"
+VERSION = 1
+PAGE_SIZE = 4096
+
+HEADER = struct.Struct("<8sIII")
+ENTRY = struct.Struct("<IIQ")
+
+# ENTRY FLAGS
+ZERO = 1 << 0 # The page was never written.
+
+MAX_NODES = 64 # Nodes that fit in an entry's holders mask.
+
+Page = collections.namedtuple("Page", ["pgnum", "flags", "holders", "data"])
+
+def DataOffset(npages):
+  end = HEADER.size + npages * ENTRY.size
+  return (end + PAGE_SIZE - 1) // PAGE_SIZE * PAGE_SIZE
+
+def HoldersMask(nodes):
+  # Bit n - 1 stands for node n. Nodes past MAX_NODES are left out and simply
+  # fault their pages back in after a warm start.
+  mask = 0
+  for node in nodes:
+    if 1 <= node <= MAX_NODES:
+      mask |= 1 << (node - 1)
+  return mask
+
+def WriteImage(path, pages):
+  # The image is written next to path and renamed into place, so a failed
+  # checkpoint never leaves a torn image behind.
+  temp = path + ".tmp"
+  with open(temp, "wb") as f:
+    f.write(HEADER.pack(MAGIC, VERSION, PAGE_SIZE, len(pages)))
+    for page in pages:
+      f.write(ENTRY.pack(page.pgnum, page.flags, page.holders))
+    f.write("\0" * (DataOffset(len(pages)) - f.tell()))
+    for page in pages:
+      f.write(page.data)
+  os.rename(temp, path)
+
+def ReadImage(path):
+  with open(path, "rb") as f:
+    data = f.read()
+  magic, version, page_size, npages = HEADER.unpack_from(data, 0)
+  if magic != MAGIC or version != VERSION or page_size != PAGE_SIZE:
+    raise ValueError(path + " is not a DSM image")
+  offset = DataOffset(npages)
+  pages = []
+  for i in range(npages):
+    pgnum, flags, holders = ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size)
+    start = offset + i * PAGE_SIZE
+    pages.append(Page(pgnum, flags, holders, data[start:start + PAGE_SIZE]))
+  return pages
@@ -0,0 +1,69 @@
+# Reader and writer for the binary fault traces recorded by libdsmu (trace.c)
+# and by the manager. The layout matches include/trace.h: a header followed by
+# fixed-size little-endian records.
+
+import collections
+import struct
+import time
+from threading import Lock
+
+MAGIC = "DSMTRACE"
+VERSION = 1
+
+HEADER = struct.Struct("<8sII")
+RECORD = struct.Struct("<QIIHBB")
+
+# ACCESS TYPES
+READ = 0
+WRITE = 1
+
+# RECORD SOURCES
+SRC_NODE = 0
+SRC_MANAGER = 1
+
+BUFFERED_RECORDS = 4096
+
+Fault = collections.namedtuple("Fault",
+    ["ts_us", "pgnum", "latency_us", "node", "access", "source"])
+
+class TraceWriter:
+  def __init__(self, path):
+    self.lock = Lock()
+    self.records = []
+    self.file = open(path, "wb")
+    self.file.write(HEADER.pack(MAGIC, VERSION, RECORD.size))
+
+  def Record(self, node, pagenumber, access, start, end):
+    # start and end are time.time() values around the handling of one request.
+    record = RECORD.pack(int(start * 1000000), pagenumber,
+        int((end - start) * 1000000), node, access, SRC_MANAGER)
+    with self.lock:
+      self.records.append(record)
+      if len(self.records) >= BUFFERED_RECORDS:
+        self.FlushLocked()
+
+  def FlushLocked(self):
+    self.file.write("".join(self.records))
+    self.file.flush()
+    self.records = []
+
+  def Flush(self):
+    with self.lock:
+      self.FlushLocked()
+
+  def Close(self):
+    with self.lock:
+      self.FlushLocked()
+      self.file.close()
+
+def ReadTrace(path):
+  # Yield the Fault records of one trace file in file order.
+  with open(path, "rb") as f:
+    magic, version, recsize = HEADER.unpack(f.read(HEADER.size))
+    if magic != MAGIC or version != VERSION or recsize != RECORD.size:
+      raise ValueError(path + " is not a version " + str(VERSION) + " DSM trace")
+    while True:
+      data = f.read(recsize)
+      if len(data) < recsize:
+        break
+      yield Fault(*RECORD.unpack(data))
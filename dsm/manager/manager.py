@@ -1,35 +1,218 @@
+import argparse
+import collections
+import errno
 import os
+import signal
 import socket
+from threading import Condition
 from threading import Lock
 from threading import Thread
 import time
-import operator
+
+import dsmimage
+import dsmtrace
+import pagecomp
 
 DEBUG=True
 
 PORT = 4444
 NUMPAGES = 1000000
 MAXCONNREQUESTS = 5
+INVALIDATE_BATCH_MAX = 512 # Pages named in one INVALIDATEBATCH message.
+PAGEDATA = " PAGEDATA "    # Raw page data follows this in a message.
+PAGEZ = " PAGEZ "          # Compressed page data follows this instead.
+PAGE_SIZE = 4096
+ZERO_PAGE = "\0" * PAGE_SIZE
 
 # PERMISSION TYPES
 NONE = "NONE"
 READ = "READ"
 WRITE = "WRITE"
 
+# ACCESS HISTORY
+HISTORY_LENGTH = 16            # Grants remembered per page.
+MIGRATE_MIN_WRITES = 4         # Writes seen before a page can get a home.
+MIGRATE_FRACTION = 0.75        # Share of recent writes that makes a node home.
+FALSE_SHARING_ALTERNATIONS = 6 # Writer hand-offs in a row that look like thrash.
+FALSE_SHARING_INTERVAL = 0.1   # Mean seconds between those hand-offs.
+
+# READ LEASES
+LEASE_GRACE_FRACTION = 0.25    # Extra wait past a lease, as a share of it,
+LEASE_GRACE_MIN = 0.002        # but at least this many seconds.
+
+class AccessHistory:
+  # Recent grants of one page, used to pick a home node for it and to spot
+  # pages that two writers keep stealing from each other.
+  def __init__(self):
+    self.grants = collections.deque(maxlen=HISTORY_LENGTH)
+    self.reads = 0
+    self.writes = 0
+    self.transfers = 0
+    self.transfer_time = 0.0
+    self.last_client = None
+    self.last_grant_time = None
+    self.home = None
+    self.migrations = 0
+    self.eager_writes = 0
+    self.falsely_shared = None
+
+  def Record(self, client, permission, now):
+    # A transfer is a grant to a different node than the previous one; the time
+    # between transfers is how long the page stayed put.
+    interval = 0.0
+    if self.last_client is not None and self.last_client != client:
+      interval = now - self.last_grant_time
+      self.transfers += 1
+      self.transfer_time += interval
+    self.last_client = client
+    self.last_grant_time = now
+
+    if permission == WRITE:
+      self.writes += 1
+    else:
+      self.reads += 1
+    self.grants.append((client, permission, interval))
+
+  def DominantWriter(self):
+    writers = [g[0] for g in self.grants if g[1] == WRITE]
+    if len(writers) < MIGRATE_MIN_WRITES:
+      return None
+    counts = collections.Counter(writers)
+    writer, count = counts.most_common(1)[0]
+    if count < MIGRATE_FRACTION * len(writers):
+      return None
+    return writer
+
+  def AlternatingWriters(self):
+    # Collapse the recent grants into runs held by one node. The page thrashes
+    # when the last few runs swap between exactly two nodes, each run writes
+    # the page, and each swap comes soon after the previous one.
+    runs = []
+    for client, permission, interval in self.grants:
+      if runs and runs[-1][0] == client:
+        runs[-1][1] = runs[-1][1] or permission == WRITE
+      else:
+        runs.append([client, permission == WRITE, interval])
+    runs = runs[-FALSE_SHARING_ALTERNATIONS:]
+    if len(runs) < FALSE_SHARING_ALTERNATIONS:
+      return None
+    if not all(run[1] for run in runs):
+      return None
+    writers = set(run[0] for run in runs)
+    if len(writers) != 2:
+      return None
+    intervals = [run[2] for run in runs[1:]]
+    if sum(intervals) / len(intervals) > FALSE_SHARING_INTERVAL:
+      return None
+    return tuple(sorted(writers))
+
+  def MeanTransferTime(self):
+    if self.transfers == 0:
+      return 0.0
+    return self.transfer_time / self.transfers
+
+class InvalidationRound:
+  # The outstanding invalidations of one page. The requesting thread waits on
+  # it until every node it invalidated has confirmed.
+  def __init__(self, targets):
+    self.pending = set(targets)
+    self.condition = Condition()
+
+  def Confirm(self, client):
+    with self.condition:
+      self.pending.discard(client)
+      if not self.pending:
+        self.condition.notify_all()
+
+  def Wait(self):
+    with self.condition:
+      while self.pending:
+        self.condition.wait()
+
+class Outbox:
+  # Everything sent to one node goes through its outbox so that messages from
+  # different request threads never interleave on the socket. Invalidations
+  # are handed to a sender thread; those posted while it is busy sending go
+  # out together in the next INVALIDATEBATCH message.
+  def __init__(self, socket):
+    self.socket = socket
+    self.send_lock = Lock()
+    self.condition = Condition()
+    self.invalidations = []
+    self.thread = Thread(target = self.Run)
+    self.thread.daemon = True
+    self.thread.start()
+
+  def Send(self, msg):
+    msg = str(len(msg)) + " " + msg
+    with self.send_lock:
+      self.socket.sendall(msg)
+
+  def PostInvalidation(self, pagenumber):
+    with self.condition:
+      self.invalidations.append(pagenumber)
+      self.condition.notify()
+
+  def Run(self):
+    while True:
+      with self.condition:
+        while not self.invalidations:
+          self.condition.wait()
+        pages = self.invalidations[:INVALIDATE_BATCH_MAX]
+        del self.invalidations[:INVALIDATE_BATCH_MAX]
+      try:
+        self.Send("INVALIDATEBATCH " + " ".join(str(p) for p in sorted(pages)))
+      except socket.error:
+        return # The node disconnected.
+
 class PageTableEntry:
   def __init__(self):
     self.lock = Lock()
     self.users = []
     self.current_permission = NONE
-    self.invalidate_confirmations = {}
-    self.b64_encoded_page = "EXISTING"
+    self.invalidation = None # InvalidationRound while invalidating.
+    self.page_data = None # Latest contents, None until a writer hands it back.
+    self.page_compressed = False # page_data is as compressed by a node.
+    self.lease_expiry = 0.0 # When the last read lease granted runs out.
+    self.from_image = False # Unchanged since it was loaded from an image.
+    self.history = None # Created on the first grant.
+
+def SplitPageData(data):
+  # Split a message into its text, the page data marker that ended it (or "")
+  # and the page data. The text never contains a marker, so the first one
+  # found is where it ends.
+  ends = [(data.find(marker), marker) for marker in (PAGEDATA, PAGEZ)]
+  ends = [end for end in ends if end[0] >= 0]
+  if not ends:
+    return data, "", ""
+  index, marker = min(ends)
+  return data[:index], marker, data[index + len(marker):]
 
 class ManagerServer:
-  def __init__(self, port, numPages):
+  def __init__(self, port, numPages, trace=None, compress=True, lease_ms=0,
+               image=None):
     self.port = port
     self.clients = {} # client ids => ip addresses
+    self.outboxes = {} # client ids => Outbox
+    self.compress = compress # Accept page compression when nodes offer it.
+    self.compressing = set() # Clients that negotiated page compression.
+    self.page_bytes = 0 # Pages handed back to the manager, in bytes.
+    self.wire_bytes = 0 # The same pages as they arrived.
+    self.lease_ms = lease_ms # Length of read leases, 0 to invalidate readers.
+    self.leasing = set() # Clients that drop read copies when leases run out.
+    self.lease_waits = 0 # Write grants that waited for leases to run out.
+    self.lease_wait_time = 0.0
+    self.leases_skipped = 0 # Reader invalidations saved by leases.
+    self.node_ids = {} # client ids => node numbers in connect order
+    self.trace = trace # dsmtrace.TraceWriter, or None when not tracing
     self.page_table_entries = [PageTableEntry() for i in range(numPages)]
+    self.touched_pages = set() # Pages that have an access history.
+    self.barrier_lock = Lock()
+    self.barrier_waiting = [] # Clients waiting at the barrier.
+    self.stats_lock = Lock()
     self.serverSocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    if image is not None:
+      self.LoadImage(image)
 
   def Listen(self):
     self.serverSocket.bind(('0.0.0.0', self.port))
@@ -43,7 +226,13 @@ class ManagerServer:
       # A client exists as long as the ManagerServer has a TCP connection to it.
       # Therefore, when a client connects here, we make a new thread to handle
       # its requests.
-      (clientSocket, address) = self.serverSocket.accept()
+      try:
+        (clientSocket, address) = self.serverSocket.accept()
+      except socket.error as e:
+        # A stats dump (SIGUSR1) interrupts accept; just go back to waiting.
+        if e.errno == errno.EINTR:
+          continue
+        raise
       if DEBUG: print "[Manager] Accepted client with address: " + str(address)
 
       # Here, we just make a new thread to handle this client and run it, and
@@ -75,7 +264,7 @@ class ManagerServer:
       except:
         break
 
-      if DEBUG: print "[Manager] " + str(client[1]) + " " + data[0:40]
+      if DEBUG: print "[Manager] " + str(client[1]) + " " + SplitPageData(data)[0][0:40]
       thread = Thread(target = self.ProcessMessage, args = (client, data.split(" ",1)[1]))
       thread.start()
 
@@ -83,72 +272,363 @@ class ManagerServer:
 
 
   def ProcessMessage(self, client, data):
-    args = data.split(" ")
-    
+    # Page data is raw bytes after the PAGEDATA or PAGEZ marker; only the text
+    # before it is split into arguments.
+    text, marker, page_data = SplitPageData(data)
+    args = text.split(" ")
+
     if args[0] == "REQUESTPAGE":
       self.RequestPage(client, int(args[2]) % NUMPAGES, args[1])
+    elif args[0] == "REQUESTPAGES":
+      # Faults a node sent together; each is served on its own thread, as if
+      # it had come in a message of its own.
+      for permission, pagenumber in zip(args[1::2], args[2::2]):
+        thread = Thread(target = self.RequestPage,
+                        args = (client, int(pagenumber) % NUMPAGES, permission))
+        thread.start()
     elif args[0] == "INVALIDATE":
-      b64_encoded_data = args[3] if len(args) > 3 else ""
-      self.InvalidateConfirmation(client, int(args[2]) % NUMPAGES, b64_encoded_data)
+      self.InvalidateConfirmation(client, int(args[2]) % NUMPAGES, page_data,
+                                  marker == PAGEZ)
+    elif args[0] == "HELLO":
+      self.Hello(client, args[1:])
+    elif args[0] == "BARRIER":
+      self.EnterBarrier(client, int(args[1]))
+    elif args[0] == "INVALIDATEBATCH":
+      for pagenumber in args[2:]:
+        self.InvalidateConfirmation(client, int(pagenumber) % NUMPAGES, "")
+    elif args[0] == "CHECKPOINT":
+      self.Checkpoint(client, text.split(" ", 1)[1])
+    elif args[0] == "WARMSTART":
+      self.WarmStart(client, [int(p) % NUMPAGES for p in args[1:]])
     else:
       print "FUCK BAD PROTOCOL " + str(args[0])
 
 
   def AddClient(self, client, socket):
     self.clients[client] = socket
+    self.outboxes[client] = Outbox(socket)
+    self.node_ids[client] = len(self.node_ids) + 1
 
   def Invalidate(self, client, pagenumber, getpage):
-    # Tell clients using the page to invalidate, wait for confirmation
+    # Tell clients using the page to invalidate, wait for confirmation.
+    invalidation = self.StartInvalidation(client, pagenumber, getpage)
+    self.FinishInvalidation(pagenumber, invalidation)
+
+  def StartInvalidation(self, client, pagenumber, getpage):
+    # Invalidations that need the page back go straight to its single writer;
+    # the others are queued on each reader's outbox, which batches them with
+    # invalidations of other pages bound for the same node. Other request
+    # threads keep running while this one waits, so fan-outs for independent
+    # pages overlap. Readers holding leases are left alone; see AwaitLeases.
     page_table_entry = self.page_table_entries[pagenumber]
-    page_table_entry.invalidate_confirmations = {}
-
-    for user in page_table_entry.users:
-      if user != client:
-        page_table_entry.invalidate_confirmations[user] = False
-
-    for user in page_table_entry.users:
-      if user != client:
-        if getpage:
-          self.Send(user, "INVALIDATE " + str(pagenumber) + " PAGEDATA")
-        else:
-          self.Send(user, "INVALIDATE " + str(pagenumber))
-
-    while not reduce(operator.and_, page_table_entry.invalidate_confirmations.values(), True):
-      pass
+    targets = [user for user in page_table_entry.users if user != client]
+    if not getpage:
+      leased = [user for user in targets if user in self.leasing]
+      targets = [user for user in targets if user not in self.leasing]
+      with self.stats_lock:
+        self.leases_skipped += len(leased)
+    if not targets:
+      return None
+
+    invalidation = InvalidationRound(targets)
+    page_table_entry.invalidation = invalidation
+    for user in targets:
+      if getpage:
+        self.Send(user, "INVALIDATE " + str(pagenumber) + " PAGEDATA")
+      else:
+        self.outboxes[user].PostInvalidation(pagenumber)
+    return invalidation
 
+  def FinishInvalidation(self, pagenumber, invalidation):
     # When all have confirmed, return
+    if invalidation is None:
+      return
+    invalidation.Wait()
+    self.page_table_entries[pagenumber].invalidation = None
 
-  def InvalidateConfirmation(self, client, pagenumber, data):
+  def InvalidateConfirmation(self, client, pagenumber, data, compressed=False):
     # Alert invalidate thread
     page_table_entry = self.page_table_entries[pagenumber]
-    page_table_entry.invalidate_confirmations[client] = True
-
     if data:
-      page_table_entry.b64_encoded_page = data
-
-  def SendConfirmation(self, client, pagenumber, permission, b64_encoded_page):
-    self.Send(client, "REQUESTPAGE " + permission + " CONFIRMATION " + str(pagenumber) + " " + str(b64_encoded_page))
+      page_table_entry.page_data = data
+      page_table_entry.page_compressed = compressed
+      with self.stats_lock:
+        self.page_bytes += PAGE_SIZE
+        self.wire_bytes += len(data)
+    page_table_entry.invalidation.Confirm(client)
+
+  def AwaitLeases(self, client, pagenumber):
+    # Wait until every other reader's lease on the page has run out, by which
+    # time they have dropped their copies on their own. Called with the page
+    # lock held, so no new lease can be granted meanwhile.
+    page_table_entry = self.page_table_entries[pagenumber]
+    if not any(user != client and user in self.leasing
+               for user in page_table_entry.users):
+      return
+    wait = page_table_entry.lease_expiry - time.time()
+    if wait <= 0:
+      return
+    time.sleep(wait)
+    with self.stats_lock:
+      self.lease_waits += 1
+      self.lease_wait_time += wait
+
+  def Lease(self, client, pagenumber, permission):
+    # Return the lease to attach to a grant, as text, and remember when it
+    # runs out. The node starts its lease when it sent the request, before
+    # this, so it drops its copy first however long the grant takes to reach
+    # it; the grace period only covers the node's timer.
+    if permission != READ or client not in self.leasing:
+      return ""
+    lease = self.lease_ms / 1000.0
+    grace = max(lease * LEASE_GRACE_FRACTION, LEASE_GRACE_MIN)
+    page_table_entry = self.page_table_entries[pagenumber]
+    page_table_entry.lease_expiry = max(page_table_entry.lease_expiry,
+                                        time.time() + lease + grace)
+    return " LEASE " + str(self.lease_ms)
+
+  def EnterBarrier(self, client, nodes):
+    # Hold the client until nodes clients have entered, then release them all.
+    with self.barrier_lock:
+      self.barrier_waiting.append(client)
+      if len(self.barrier_waiting) < nodes:
+        return
+      waiting = self.barrier_waiting
+      self.barrier_waiting = []
+    for user in waiting:
+      self.Send(user, "BARRIER RELEASE")
+
+  def Hello(self, client, features):
+    # Agree on optional protocol features with a newly connected node, and
+    # learn its node number if it has one.
+    accepted = []
+    if "ID" in features:
+      node = int(features[features.index("ID") + 1])
+      if node > 0:
+        self.node_ids[client] = node
+    if "COMPRESS" in features and self.compress:
+      self.compressing.add(client)
+      accepted.append("COMPRESS")
+    if "LEASE" in features and self.lease_ms > 0:
+      self.leasing.add(client)
+      accepted.append("LEASE")
+    self.Send(client, " ".join(["HELLO"] + accepted))
+
+  def Checkpoint(self, client, path):
+    # Write an image of every page in use to path, on the manager's machine.
+    # All their locks are held while it is taken and writers hand their pages
+    # back first, so no node can change a page once it is in the image and the
+    # image is a consistent cut. Writers' pages are fetched all at once.
+    with self.stats_lock:
+      pagenumbers = sorted(self.touched_pages)
+    entries = [self.page_table_entries[p] for p in pagenumbers]
+    for page_table_entry in entries:
+      page_table_entry.lock.acquire()
+    try:
+      holders = []
+      fetches = []
+      for pagenumber, page_table_entry in zip(pagenumbers, entries):
+        holders.append(dsmimage.HoldersMask(self.node_ids[user]
+                                            for user in page_table_entry.users))
+        if page_table_entry.current_permission == WRITE:
+          fetches.append((pagenumber,
+                          self.StartInvalidation(None, pagenumber, True)))
+      for pagenumber, invalidation in fetches:
+        self.FinishInvalidation(pagenumber, invalidation)
+        page_table_entry = self.page_table_entries[pagenumber]
+        page_table_entry.users = []
+        page_table_entry.current_permission = READ
+
+      pages = []
+      for pagenumber, page_table_entry, mask in zip(pagenumbers, entries,
+                                                    holders):
+        data = page_table_entry.page_data
+        if data is None:
+          pages.append(dsmimage.Page(pagenumber, dsmimage.ZERO, mask,
+                                     ZERO_PAGE))
+          continue
+        if page_table_entry.page_compressed:
+          data = pagecomp.Decompress(data)
+        pages.append(dsmimage.Page(pagenumber, 0, mask, data))
+      dsmimage.WriteImage(path, pages)
+      status = "OK"
+      if DEBUG: print "[Manager] checkpoint of " + str(len(pages)) + \
+          " pages written to " + path
+    except (IOError, OSError) as e:
+      status = "FAILED"
+      print "[Manager] checkpoint to " + path + " failed: " + str(e)
+    finally:
+      for page_table_entry in entries:
+        page_table_entry.lock.release()
+    self.Send(client, "CHECKPOINT " + status)
+
+  def LoadImage(self, path):
+    # Start from an image written by Checkpoint. Its pages are read-only with
+    # no users, so the first write to each invalidates nobody, and restarted
+    # nodes can claim read copies of them with WARMSTART.
+    pages = dsmimage.ReadImage(path)
+    for page in pages:
+      page_table_entry = self.page_table_entries[page.pgnum % NUMPAGES]
+      page_table_entry.current_permission = READ
+      if not page.flags & dsmimage.ZERO:
+        page_table_entry.page_data = page.data
+      page_table_entry.from_image = True
+      page_table_entry.history = AccessHistory()
+      self.touched_pages.add(page.pgnum % NUMPAGES)
+    print "[Manager] loaded " + str(len(pages)) + " pages from " + path
+
+  def WarmStart(self, client, pagenumbers):
+    # A restarted node offers to install read copies of pages from an image.
+    # Accept those still unchanged since the manager loaded that image and
+    # reply with them; the node installs only what was accepted. The page locks
+    # are taken in order, as in Checkpoint, and held until the reply is sent,
+    # so an invalidation of an accepted page reaches the node after the reply.
+    # Pages the node already holds are left as they are.
+    entries = [self.page_table_entries[p] for p in sorted(set(pagenumbers))]
+    for page_table_entry in entries:
+      page_table_entry.lock.acquire()
+    try:
+      accepted = []
+      lease = ""
+      # The node expects accepted pages in the order it offered them.
+      for pagenumber in pagenumbers:
+        page_table_entry = self.page_table_entries[pagenumber]
+        if not page_table_entry.from_image or \
+            page_table_entry.current_permission != READ or \
+            client in page_table_entry.users:
+          continue
+        page_table_entry.users.append(client)
+        lease = self.Lease(client, pagenumber, READ)
+        accepted.append(str(pagenumber))
+      self.Send(client, " ".join(["WARMSTART CONFIRMATION" + lease] + accepted))
+    finally:
+      for page_table_entry in entries:
+        page_table_entry.lock.release()
+
+  def SendConfirmation(self, client, pagenumber, permission, page_data,
+                       compressed=False):
+    # Pages are forwarded as the last writer sent them, and only expanded for
+    # nodes that do not take compressed pages.
+    msg = "REQUESTPAGE " + permission + " CONFIRMATION " + str(pagenumber) + \
+        self.Lease(client, pagenumber, permission)
+    if page_data is None:
+      self.Send(client, msg + " EXISTING")
+    elif compressed and client in self.compressing:
+      self.Send(client, msg + PAGEZ + page_data)
+    elif compressed:
+      self.Send(client, msg + PAGEDATA + pagecomp.Decompress(page_data))
+    else:
+      self.Send(client, msg + PAGEDATA + page_data)
   
   def Send(self, client, msg):
-    socket = self.clients[client]
-    msg = str(len(msg)) + " " + msg
-    socket.send(msg)
+    self.outboxes[client].Send(msg)
+
+  def RecordGrant(self, client, pagenumber, permission):
+    # Update the page's access history, move its home to the dominant writer
+    # and flag it when two writers are thrashing it. Called with the page lock
+    # held.
+    page_table_entry = self.page_table_entries[pagenumber]
+    history = page_table_entry.history
+    if history is None:
+      history = page_table_entry.history = AccessHistory()
+      with self.stats_lock:
+        self.touched_pages.add(pagenumber)
+    history.Record(client, permission, time.time())
+
+    home = history.DominantWriter()
+    if home is not None and home != history.home:
+      history.home = home
+      history.migrations += 1
+      if DEBUG: print "[Manager] page " + str(pagenumber) + " home -> " + str(home[1])
+
+    writers = history.AlternatingWriters()
+    if writers is not None and history.falsely_shared is None:
+      history.falsely_shared = writers
+      print "[Manager] page " + str(pagenumber) + " is falsely shared by " + \
+          str(writers[0][1]) + " and " + str(writers[1][1])
+
+  def GrantedPermission(self, client, pagenumber, permission):
+    # A read fault from the page's home is answered with write ownership when
+    # that costs no extra invalidations, saving the write fault that follows.
+    page_table_entry = self.page_table_entries[pagenumber]
+    history = page_table_entry.history
+    if permission != READ or history is None or history.home != client:
+      return permission
+    if page_table_entry.current_permission == READ and \
+        any(user != client for user in page_table_entry.users):
+      return permission
+    history.eager_writes += 1
+    return WRITE
+
+  def DumpStats(self, *args):
+    # Print per-page access statistics for every page that migrated or looks
+    # falsely shared, followed by totals. Triggered by SIGUSR1 and on exit.
+    with self.stats_lock:
+      pages = sorted(self.touched_pages)
+    migrated = 0
+    falsely_shared = 0
+    transfers = 0
+    eager_writes = 0
+    print "[Manager] === page access stats (" + str(len(pages)) + " pages) ==="
+    print "%10s %8s %8s %9s %12s %8s %10s %s" % ("page", "reads", "writes",
+        "transfers", "mean_us", "home", "migrations", "falsely_shared")
+    for pagenumber in pages:
+      history = self.page_table_entries[pagenumber].history
+      transfers += history.transfers
+      eager_writes += history.eager_writes
+      if history.migrations > 0:
+        migrated += 1
+      if history.falsely_shared is not None:
+        falsely_shared += 1
+      if history.migrations == 0 and history.falsely_shared is None:
+        continue
+      home = str(history.home[1]) if history.home is not None else "-"
+      shared = "-"
+      if history.falsely_shared is not None:
+        shared = "/".join(str(w[1]) for w in history.falsely_shared)
+      print "%10d %8d %8d %9d %12.1f %8s %10d %s" % (pagenumber, history.reads,
+          history.writes, history.transfers,
+          history.MeanTransferTime() * 1000000, home, history.migrations, shared)
+    print "[Manager] transfers: " + str(transfers) + ", migrated pages: " + \
+        str(migrated) + ", eager write grants: " + str(eager_writes) + \
+        ", falsely shared pages: " + str(falsely_shared)
+    if self.wire_bytes > 0:
+      print "[Manager] page data received: " + str(self.page_bytes) + \
+          " bytes in " + str(self.wire_bytes) + " on the wire, ratio %.2f" % \
+          (float(self.wire_bytes) / self.page_bytes)
+    if self.lease_ms > 0:
+      print "[Manager] reader invalidations skipped for leases: " + \
+          str(self.leases_skipped) + ", write grants that waited: " + \
+          str(self.lease_waits) + ", total wait: %.1f ms" % \
+          (self.lease_wait_time * 1000)
+    if self.trace is not None:
+      self.trace.Flush()
 
   def RequestPage(self, client, pagenumber, permission):
     # Invalidate page with other clients (if necessary)
     # Make sure client has latests page, ask other client to send page if necessary
+    start = time.time()
+    requested = permission
     page_table_entry = self.page_table_entries[pagenumber]
     page_table_entry.lock.acquire()
+    permission = self.GrantedPermission(client, pagenumber, permission)
+    # The history records what the node asked for: a read answered with an
+    # eager write grant must not count as a write, or it would feed the home
+    # choice and false-sharing detection that decided to upgrade it.
+    self.RecordGrant(client, pagenumber, requested)
 
     # Initial use of page FAULT HANDLER
     if page_table_entry.current_permission == NONE:
       page_table_entry.current_permission = permission
       page_table_entry.users = [client]
-      self.SendConfirmation(client, pagenumber, permission, page_table_entry.b64_encoded_page)
+      self.SendConfirmation(client, pagenumber, permission,
+                            page_table_entry.page_data,
+                            page_table_entry.page_compressed)
 
       if permission == READ:
         page_table_entry.users= [client]
 
+      self.TraceRequest(client, pagenumber, requested, start)
       page_table_entry.lock.release()
       return
 
@@ -157,26 +637,58 @@ class ManagerServer:
       if page_table_entry.current_permission == WRITE:
         self.Invalidate(client, pagenumber, True)
         page_table_entry.users = [client]
-      else:
+      elif client not in page_table_entry.users:
         page_table_entry.users.append(client)
 
     # WRITE FAULT HANDLER
     if permission == WRITE:
+      page_table_entry.from_image = False
       if page_table_entry.current_permission == WRITE:
         self.Invalidate(client, pagenumber, True)
       else:
         self.Invalidate(client, pagenumber, False)
+        self.AwaitLeases(client, pagenumber)
       page_table_entry.users = [client]
 
-    self.SendConfirmation(client, pagenumber, permission, page_table_entry.b64_encoded_page)
+    self.SendConfirmation(client, pagenumber, permission,
+                          page_table_entry.page_data,
+                          page_table_entry.page_compressed)
     page_table_entry.current_permission = permission
+    self.TraceRequest(client, pagenumber, requested, start)
     page_table_entry.lock.release()
 
+  def TraceRequest(self, client, pagenumber, permission, start):
+    if self.trace is None:
+      return
+    access = dsmtrace.WRITE if permission == WRITE else dsmtrace.READ
+    self.trace.Record(self.node_ids[client], pagenumber, access, start, time.time())
+
 if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="DSM page manager")
+  parser.add_argument("--port", type=int, default=PORT)
+  parser.add_argument("--no-compress", dest="compress", action="store_false",
+      help="refuse page compression when nodes offer it")
+  parser.add_argument("--lease-ms", type=int, default=0,
+      help="grant read copies for this long instead of invalidating them")
+  parser.add_argument("--image", metavar="FILE",
+      help="start from a checkpoint image (see dsm_checkpoint)")
+  parser.add_argument("--trace", metavar="FILE",
+      help="record every page request to FILE (see replay.py)")
+  options = parser.parse_args()
+
+  trace = None
+  if options.trace:
+    trace = dsmtrace.TraceWriter(options.trace)
+
   try:
-    manager = ManagerServer(PORT, NUMPAGES)
+    manager = ManagerServer(options.port, NUMPAGES, trace, options.compress,
+                            options.lease_ms, options.image)
+    signal.signal(signal.SIGUSR1, manager.DumpStats)
     manager.Listen()
   except KeyboardInterrupt:
+    manager.DumpStats()
+    if trace is not None:
+      trace.Close()
     for c, s in manager.clients.iteritems():
       s.close()
     os._exit(0)
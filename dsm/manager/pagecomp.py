@@ -0,0 +1,19 @@
+# Decoder for pages compressed by libdsmu (see include/pagecomp.h). The
+# manager stores compressed pages as it got them and only expands one when it
+# must hand the page to a node that did not negotiate compression.
+
+PAGE_SIZE = 4096
+TAG_BYTES = 256
+WORDS_PER_PAGE = PAGE_SIZE / 4
+
+def Decompress(data):
+  tags = bytearray(data[:TAG_BYTES])
+  out = bytearray(PAGE_SIZE)
+  p = TAG_BYTES
+  for i in xrange(WORDS_PER_PAGE):
+    n = (0, 1, 2, 4)[(tags[i / 4] >> ((i % 4) * 2)) & 3]
+    out[i * 4:i * 4 + n] = data[p:p + n]
+    p += n
+  if p != len(data):
+    raise ValueError("corrupt compressed page")
+  return str(out)
@@ -0,0 +1,266 @@
+# Replay recorded fault traces through simulated coherence protocols.
+#
+# Traces come from libdsmu (run a node with DSM_TRACE=FILE) or from the manager
+# (manager.py --trace FILE). Each protocol variant replays the same faults
+# against its own page table and counts the messages it would exchange; a
+# simple network model turns those messages into latency.
+#
+#   $ python manager/replay.py node1.trace node2.trace
+#   $ python manager/replay.py --net-us 200 --mbps 100 manager.trace
+
+import argparse
+import collections
+import heapq
+import sys
+
+import dsmtrace
+
+PAGE_SIZE = 4096
+HEADER_BYTES = 40    # A protocol message without page data.
+
+class CostModel:
+  def __init__(self, net_us, mbps, msg_us, batch_us, compress_ratio,
+               lease_us):
+    self.net_us = net_us                  # One-way network latency.
+    self.us_per_byte = 1.0 / mbps         # 1 MB/s moves 1 byte per us.
+    self.msg_us = msg_us                  # Send/receive overhead per message.
+    self.batch_us = batch_us              # Window for merging invalidations.
+    self.compress_ratio = compress_ratio  # Compressed page size / PAGE_SIZE.
+    self.lease_us = lease_us              # Length of a read lease.
+
+  def Message(self, nbytes):
+    # Latency of one message carrying nbytes of payload.
+    return self.msg_us + self.net_us + (HEADER_BYTES + nbytes) * self.us_per_byte
+
+class PageState:
+  def __init__(self):
+    self.permission = dsmtrace.READ
+    self.users = set()
+    self.written = False    # Has data other than the initial zero page.
+    self.writers = collections.deque(maxlen=16)
+    self.home = None
+    self.leases = {}        # node => when its read lease runs out (Leased)
+
+class Stats:
+  def __init__(self):
+    self.faults = 0
+    self.avoided = 0
+    self.messages = 0
+    self.bytes = 0
+    self.latency_us = 0.0
+
+class Ivy:
+  # The protocol manager.py implements: one manager, many readers or a single
+  # writer per page, invalidations sent one at a time.
+  name = "ivy"
+
+  def __init__(self, cost):
+    self.cost = cost
+    self.pages = {}
+    self.stats = Stats()
+    self.now = 0    # Timestamp of the fault being replayed.
+
+  def Holds(self, page, node, access):
+    # True if node can already perform access without faulting.
+    if node not in page.users:
+      return False
+    return access == dsmtrace.READ or page.permission == dsmtrace.WRITE
+
+  def Granted(self, page, node, access):
+    return access
+
+  def Send(self, nbytes):
+    self.stats.messages += 1
+    self.stats.bytes += HEADER_BYTES + nbytes
+    return self.cost.Message(nbytes)
+
+  def Invalidate(self, page, node, getpage):
+    # The manager sends every INVALIDATE before it waits for any confirmation,
+    # so the round trips overlap but the sends are serialized.
+    targets = [user for user in page.users if user != node]
+    if not targets:
+      return 0.0
+    payload = PAGE_SIZE if getpage else 0
+    sends = [self.Send(0) for user in targets]
+    confirms = [self.Send(payload) for user in targets]
+    return (len(targets) - 1) * self.cost.msg_us + max(sends) + max(confirms)
+
+  def Fault(self, fault):
+    node, pgnum, access = fault.node, fault.pgnum, fault.access
+    self.now = fault.ts_us
+    page = self.pages.get(pgnum)
+    if page is None:
+      page = self.pages[pgnum] = PageState()
+    if self.Holds(page, node, access):
+      self.stats.avoided += 1
+      return
+
+    granted = self.Granted(page, node, access)
+    latency = self.Send(0)  # REQUESTPAGE
+    if granted == dsmtrace.READ:
+      if page.permission == dsmtrace.WRITE:
+        latency += self.Invalidate(page, node, True)
+        page.users = set()
+      page.users.add(node)
+    else:
+      latency += self.Invalidate(page, node,
+                                 page.permission == dsmtrace.WRITE)
+      page.users = set([node])
+      page.writers.append(node)
+    latency += self.Send(PAGE_SIZE if page.written else 0)  # CONFIRMATION
+    if granted == dsmtrace.WRITE:
+      page.written = True
+    page.permission = granted
+
+    self.stats.faults += 1
+    self.stats.latency_us += latency
+
+class HomeMigration(Ivy):
+  # Ivy plus the manager's home migration: the dominant recent writer of a
+  # page gets write ownership on a read fault when nobody else must be
+  # invalidated.
+  name = "home-migration"
+
+  def Granted(self, page, node, access):
+    writers = list(page.writers)
+    if len(writers) >= 4:
+      top = max(set(writers), key=writers.count)
+      if writers.count(top) >= 0.75 * len(writers):
+        page.home = top
+    if access != dsmtrace.READ or page.home != node:
+      return access
+    if page.permission == dsmtrace.READ and \
+        any(user != node for user in page.users):
+      return access
+    return dsmtrace.WRITE
+
+class Pipelined(Ivy):
+  # Ivy with the manager's outboxes: read copies are invalidated in parallel,
+  # and invalidations bound for a node within batch_us of the previous one
+  # share its INVALIDATEBATCH message and confirmation.
+  name = "pipelined"
+
+  def __init__(self, cost):
+    Ivy.__init__(self, cost)
+    self.batches = {}   # node => when its current batch was sent
+
+  def Invalidate(self, page, node, getpage):
+    if getpage:
+      return Ivy.Invalidate(self, page, node, getpage)
+    targets = [user for user in page.users if user != node]
+    if not targets:
+      return 0.0
+    latency = 0.0
+    for user in targets:
+      sent = self.batches.get(user)
+      if sent is not None and self.now - sent <= self.cost.batch_us:
+        # Rides along in a batch already on the wire.
+        latency = max(latency, sent + 2 * self.cost.Message(0) - self.now)
+        continue
+      self.batches[user] = self.now
+      latency = max(latency, self.Send(0) + self.Send(0))
+    return latency
+
+class Compressed(Pipelined):
+  # Pipelined, with page data compressed on the wire (DSM_COMPRESS=1).
+  name = "compressed"
+
+  def Send(self, nbytes):
+    return Pipelined.Send(self, int(nbytes * self.cost.compress_ratio))
+
+class Leased(Ivy):
+  # Ivy with read leases (manager.py --lease-ms): readers drop their copies
+  # when the lease runs out, so a writer waits for the last lease instead of
+  # invalidating readers, and a reader faults again once its lease is over.
+  name = "leased"
+
+  def Holds(self, page, node, access):
+    if not Ivy.Holds(self, page, node, access):
+      return False
+    return page.permission == dsmtrace.WRITE or \
+        page.leases.get(node, 0) > self.now
+
+  def Invalidate(self, page, node, getpage):
+    if getpage:
+      return Ivy.Invalidate(self, page, node, getpage)
+    expiry = max([page.leases.get(user, 0) for user in page.users
+                  if user != node] + [0])
+    return max(0.0, expiry - self.now)
+
+  def Fault(self, fault):
+    faults = self.stats.faults
+    Ivy.Fault(self, fault)
+    page = self.pages[fault.pgnum]
+    if self.stats.faults == faults:
+      return  # Served by a copy it still holds.
+    if page.permission == dsmtrace.READ:
+      page.leases[fault.node] = self.now + self.cost.lease_us
+    else:
+      page.leases = {}
+
+VARIANTS = [Ivy, HomeMigration, Pipelined, Compressed, Leased]
+
+def MergedFaults(paths, source):
+  # Merge the traces by timestamp, keeping one source so that a node trace
+  # and a manager trace of the same run are not counted twice.
+  traces = [dsmtrace.ReadTrace(path) for path in paths]
+  for fault in heapq.merge(*traces):
+    if source is None or fault.source == source:
+      yield fault
+
+def main():
+  parser = argparse.ArgumentParser(description="Replay DSM fault traces.")
+  parser.add_argument("traces", nargs="+", metavar="TRACE")
+  parser.add_argument("--source", choices=["node", "manager"],
+      help="only replay records from this source")
+  parser.add_argument("--net-us", type=float, default=50.0,
+      help="one-way network latency in microseconds")
+  parser.add_argument("--mbps", type=float, default=100.0,
+      help="link bandwidth in MB/s")
+  parser.add_argument("--msg-us", type=float, default=5.0,
+      help="per-message send/receive overhead in microseconds")
+  parser.add_argument("--batch-us", type=float, default=100.0,
+      help="invalidations to one node this close together share a message")
+  parser.add_argument("--compress-ratio", type=float, default=0.5,
+      help="compressed page size as a fraction of a page")
+  parser.add_argument("--lease-us", type=float, default=1000.0,
+      help="length of a read lease in microseconds")
+  options = parser.parse_args()
+
+  source = None
+  if options.source == "node":
+    source = dsmtrace.SRC_NODE
+  elif options.source == "manager":
+    source = dsmtrace.SRC_MANAGER
+
+  cost = CostModel(options.net_us, options.mbps, options.msg_us,
+                   options.batch_us, options.compress_ratio,
+                   options.lease_us)
+  protocols = [variant(cost) for variant in VARIANTS]
+
+  recorded = 0
+  measured_us = 0
+  for fault in MergedFaults(options.traces, source):
+    recorded += 1
+    measured_us += fault.latency_us
+    for protocol in protocols:
+      protocol.Fault(fault)
+
+  if recorded == 0:
+    print "No faults to replay."
+    return 1
+
+  print "%d recorded faults, measured mean latency %.1f us" % (recorded,
+      float(measured_us) / recorded)
+  print "%-16s %8s %8s %9s %10s %12s %9s" % ("protocol", "faults", "avoided",
+      "messages", "MB", "modeled_ms", "mean_us")
+  for protocol in protocols:
+    stats = protocol.stats
+    mean = stats.latency_us / stats.faults if stats.faults else 0.0
+    print "%-16s %8d %8d %9d %10.2f %12.1f %9.1f" % (protocol.name,
+        stats.faults, stats.avoided, stats.messages,
+        stats.bytes / 1000000.0, stats.latency_us / 1000.0, mean)
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main())
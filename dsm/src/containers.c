@@ -0,0 +1,173 @@
+#include <string.h>
+
+#include "containers.h"
+
+// Mix all key bits into the result (the splitmix64 finalizer), so that keys
+// which differ only in high bits still spread over groups and slots.
+static uint64_t hashkey(uint64_t key) {
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+int dsmht_init(struct dsmht *ht, void *base, size_t ngroups, int nodes,
+               int id) {
+  if (((uintptr_t)base & (PG_SIZE - 1)) != 0 || ngroups == 0 || nodes < 1) {
+    return -1;
+  }
+  ht->groups = base;
+  ht->ngroups = ngroups;
+  ht->nodes = nodes;
+  ht->id = id;
+  return pthread_mutex_init(&ht->lock, NULL);
+}
+
+static size_t groupof(struct dsmht *ht, uint64_t hash) {
+  return hash % ht->ngroups;
+}
+
+int dsmht_owner(struct dsmht *ht, uint64_t key) {
+  size_t g = groupof(ht, hashkey(key));
+  return g * ht->nodes / ht->ngroups + 1;
+}
+
+static int reserved(uint64_t key) {
+  return key == 0 || key == DSMHT_TOMBSTONE;
+}
+
+// Find key in its group. Return its slot, or NULL; if free is not NULL, also
+// set it to the first slot the key could be put in.
+static struct dsmht_slot *probe(struct dsmht *ht, uint64_t key,
+                                struct dsmht_slot **free) {
+  uint64_t hash = hashkey(key);
+  struct dsmht_group *group = &ht->groups[groupof(ht, hash)];
+  size_t start = (hash / ht->ngroups) % DSMHT_SLOTS;
+  size_t i;
+
+  if (free != NULL) {
+    *free = NULL;
+  }
+  for (i = 0; i < DSMHT_SLOTS; i++) {
+    struct dsmht_slot *slot = &group->slots[(start + i) % DSMHT_SLOTS];
+    if (slot->key == key) {
+      return slot;
+    }
+    if (slot->key == DSMHT_TOMBSTONE) {
+      if (free != NULL && *free == NULL) {
+        *free = slot;
+      }
+      continue;
+    }
+    if (slot->key == 0) {
+      if (free != NULL && *free == NULL) {
+        *free = slot;
+      }
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int dsmht_put(struct dsmht *ht, uint64_t key, uint64_t value) {
+  struct dsmht_slot *slot, *free;
+
+  if (reserved(key)) {
+    return DSMHT_BADKEY;
+  }
+  if (dsmht_owner(ht, key) != ht->id) {
+    return DSMHT_NOT_OWNER;
+  }
+  pthread_mutex_lock(&ht->lock);
+  slot = probe(ht, key, &free);
+  if (slot == NULL) {
+    if (free == NULL) {
+      pthread_mutex_unlock(&ht->lock);
+      return DSMHT_FULL;
+    }
+    // Readers do not lock, so the key goes in only once its value is there.
+    free->value = value;
+    __atomic_store_n(&free->key, key, __ATOMIC_RELEASE);
+  } else {
+    slot->value = value;
+  }
+  pthread_mutex_unlock(&ht->lock);
+  return DSMHT_OK;
+}
+
+int dsmht_get(struct dsmht *ht, uint64_t key, uint64_t *value) {
+  if (reserved(key)) {
+    return 0;
+  }
+  struct dsmht_slot *slot = probe(ht, key, NULL);
+  if (slot == NULL) {
+    return 0;
+  }
+  *value = slot->value;
+  return 1;
+}
+
+int dsmht_del(struct dsmht *ht, uint64_t key) {
+  struct dsmht_slot *slot;
+
+  if (reserved(key)) {
+    return DSMHT_BADKEY;
+  }
+  if (dsmht_owner(ht, key) != ht->id) {
+    return DSMHT_NOT_OWNER;
+  }
+  pthread_mutex_lock(&ht->lock);
+  slot = probe(ht, key, NULL);
+  if (slot != NULL) {
+    slot->key = DSMHT_TOMBSTONE;
+  }
+  pthread_mutex_unlock(&ht->lock);
+  return slot != NULL ? DSMHT_OK : DSMHT_MISSING;
+}
+
+int dsmvec_init(struct dsmvec *v, void *base, size_t len, size_t elemsize,
+                int owner, int id) {
+  if (((uintptr_t)base & (PG_SIZE - 1)) != 0 || elemsize == 0 ||
+      elemsize > PG_SIZE || len < 2 * PG_SIZE) {
+    return -1;
+  }
+  v->header = base;
+  v->data = (char *)base + PG_SIZE;
+  v->elemsize = elemsize;
+  v->perpage = PG_SIZE / elemsize;
+  v->capacity = (len / PG_SIZE - 1) * v->perpage;
+  v->owner = owner;
+  v->id = id;
+  return 0;
+}
+
+size_t dsmvec_size(struct dsmvec *v) {
+  return __atomic_load_n(&v->header->length, __ATOMIC_ACQUIRE);
+}
+
+static void *element(struct dsmvec *v, size_t i) {
+  return v->data + (i / v->perpage) * PG_SIZE + (i % v->perpage) * v->elemsize;
+}
+
+void *dsmvec_at(struct dsmvec *v, size_t i) {
+  if (i >= __atomic_load_n(&v->header->length, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return element(v, i);
+}
+
+long dsmvec_push(struct dsmvec *v, const void *elem) {
+  if (v->id != v->owner) {
+    return -1;
+  }
+  size_t i = v->header->length;
+  if (i >= v->capacity) {
+    return -1;
+  }
+  // Fill the element before publishing the new length.
+  memcpy(element(v, i), elem, v->elemsize);
+  __atomic_store_n(&v->header->length, i + 1, __ATOMIC_RELEASE);
+  return i;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "containers.h"
+#include "libdsmu.h"
+#include "mem.h"
+
+// Keys 1..KEYS are spread over NGROUPS bucket-group pages, each node inserting
+// the keys whose groups it owns. Every node then looks up random keys twice:
+// the first round faults in read copies of the other nodes' groups, the
+// second runs from those cached copies. Node 1 finally fills a vector that
+// everybody reads back.
+#define BASE 0x12340000
+#define NGROUPS 1024
+#define KEYS 100000
+#define LOOKUPS 200000
+#define VEC_PAGES 64
+#define SEED 69
+
+int id;
+
+struct record {
+  uint64_t key;
+  uint64_t value;
+  char pad[48];
+};
+
+static double now_ms(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static uint64_t valueof(uint64_t key) {
+  return key * 31 + 7;
+}
+
+// Look up LOOKUPS random keys. Return the number of wrong answers.
+static int lookups(struct dsmht *ht, const char *label) {
+  int i, bad = 0;
+  double start = now_ms();
+  for (i = 0; i < LOOKUPS; i++) {
+    uint64_t key = rand() % KEYS + 1;
+    uint64_t value;
+    if (!dsmht_get(ht, key, &value) || value != valueof(key)) {
+      bad++;
+    }
+  }
+  double ms = now_ms() - start;
+  printf("%s: %d lookups in %.1f ms, %.0f ops/s\n", label, LOOKUPS, ms,
+         LOOKUPS / (ms / 1000.0));
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 5) {
+    printf("Usage: main MANAGER_IP MANAGER_PORT id[1|2|...|n] nodes[n]\n");
+    return 1;
+  }
+
+  char *ip = argv[1];
+  int port = atoi(argv[2]);
+  id = atoi(argv[3]);
+  int n = atoi(argv[4]);
+  srand(SEED + id);
+
+  initlibdsmu(ip, port, BASE, PG_SIZE * (NGROUPS + VEC_PAGES));
+
+  struct dsmht ht;
+  struct dsmvec v;
+  if (dsmht_init(&ht, (void *)BASE, NGROUPS, n, id) != 0 ||
+      dsmvec_init(&v, (void *)(BASE + NGROUPS * PG_SIZE), VEC_PAGES * PG_SIZE,
+                  sizeof(struct record), 1, id) != 0) {
+    fprintf(stderr, "Could not set up the containers.\n");
+    return 1;
+  }
+
+  // Every write lands in a group this node owns, so no page changes hands.
+  uint64_t key;
+  int mine = 0;
+  double start = now_ms();
+  for (key = 1; key <= KEYS; key++) {
+    if (dsmht_owner(&ht, key) != id) {
+      continue;
+    }
+    if (dsmht_put(&ht, key, valueof(key)) != DSMHT_OK) {
+      fprintf(stderr, "put of key %lu failed\n", (unsigned long)key);
+      return 1;
+    }
+    mine++;
+  }
+  double ms = now_ms() - start;
+  printf("insert: %d keys in %.1f ms, %.0f ops/s\n", mine, ms,
+         mine / (ms / 1000.0));
+
+  dsm_barrier(n);
+
+  int bad = lookups(&ht, "lookup (cold)");
+  bad += lookups(&ht, "lookup (cached)");
+
+  // Node 1 appends; everybody reads the vector once it is complete.
+  if (id == 1) {
+    struct record r = {0};
+    for (key = 1; key <= v.capacity; key++) {
+      r.key = key;
+      r.value = valueof(key);
+      dsmvec_push(&v, &r);
+    }
+  }
+  dsm_barrier(n);
+
+  size_t i;
+  start = now_ms();
+  for (i = 0; i < dsmvec_size(&v); i++) {
+    struct record *r = dsmvec_at(&v, i);
+    if (r->key != i + 1 || r->value != valueof(i + 1)) {
+      bad++;
+    }
+  }
+  printf("vector: read %zu records in %.1f ms\n", dsmvec_size(&v),
+         now_ms() - start);
+
+  if (bad == 0) {
+    printf("verify: OK\n");
+  } else {
+    printf("verify: %d wrong entries\n", bad);
+  }
+  dsm_barrier(n);
+  printf("done\n");
+
+  teardownlibdsmu();
+  return bad != 0;
+}
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE  // memfd_create
+
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
@@ -7,16 +11,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <time.h>
 #include <ucontext.h>
+#include <unistd.h>
 
-#include "b64.h"
+#include "image.h"
 #include "libdsmu.h"
 #include "mem.h"
 #include "rpc.h"
+#include "trace.h"
 
-int writehandler(void *pg);
-int readhandler(void *pg);
 void pgfaultsh(int sig, siginfo_t *info, ucontext_t *ctx);
 
 extern int id;  // For timing debug output.
@@ -31,12 +38,86 @@ static struct sigaction oldact;
 int nextshrp;
 struct sharedregion shrp[MAX_SHARED_REGIONS];
 
-pthread_condattr_t waitca[MAX_SHARED_PAGES];
-pthread_cond_t waitc[MAX_SHARED_PAGES];
-pthread_mutex_t waitm[MAX_SHARED_PAGES];
+// Page faults. The SIGSEGV handler only posts a request, which lives on its
+// own stack, to a lock-free stack and sleeps on a futex in the request. The
+// fault-service thread takes all posted faults at once and asks the manager
+// for their pages in one message, and the listener thread installs each
+// granted page and wakes the faults waiting for it (completefault).
+struct faultreq {
+  int pgnum;
+  int write;
+  uint64_t start_us;
+  uint32_t done;           // Futex word, 1 once the page is installed.
+  struct faultreq *next;   // Next in the queue, then among a fetch's waiters.
+};
+static struct faultreq *faultq;  // Posted faults, newest first.
+static uint32_t faultseq;        // Futex word, bumped on every post.
+static pthread_t tfault;
+
+// Pages requested from the manager and not yet granted, with the faults
+// waiting for each. faultm also guards leaseexp below.
+struct fetch {
+  int pgnum;
+  uint64_t sent_us;  // When it was asked for, on the monotonic clock.
+  struct faultreq *waiters;
+  struct fetch *next;
+};
+pthread_mutex_t faultm = PTHREAD_MUTEX_INITIALIZER;
+static struct fetch *fetches;
 
 static pthread_t tlisten;
 
+// Barrier state. barriergen counts releases from the manager.
+pthread_mutex_t barrierm = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t barrierc = PTHREAD_COND_INITIALIZER;
+int barriergen;
+
+// Checkpoint state. checkpointgen counts the manager's replies.
+pthread_mutex_t checkpointm = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpointc = PTHREAD_COND_INITIALIZER;
+int checkpointgen;
+int checkpointok;
+
+// Pages offered to the manager per WARMSTART message, few enough that the
+// reply fits the listener's message buffer.
+#define WARM_BATCH 512
+
+// Warm start state. The batch being offered waits in warmpending for the
+// listener, which installs the pages the manager accepted as it reads the
+// reply; warmgen counts the replies.
+struct warmbatch {
+  const char *image;
+  const struct imageentry *entries;
+  size_t dataoff;
+  int *idx;  // The batch's entries, in the order their pages were offered.
+  int n;
+  uint64_t sent_us;  // When they were offered, on the monotonic clock.
+  int installed;
+};
+static pthread_mutex_t warmm = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warmc = PTHREAD_COND_INITIALIZER;
+static struct warmbatch *warmpending;
+static int warmgen;
+
+// Read leases. A read grant can carry a lease, after which this node drops its
+// copy by itself instead of being sent an invalidation. Leases all have the
+// manager's one length, so they run out in the order they were granted and
+// the queue below is sorted by expiry. leaseexp holds each page's current
+// lease, 0 if none, so that queue entries for renewed or upgraded pages are
+// skipped. It is guarded by faultm.
+struct lease {
+  int pgnum;
+  uint64_t expiry_us;
+};
+static pthread_mutex_t leasem = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t leasec;
+static struct lease *leases;  // Ring buffer of leasecap entries.
+static size_t leasecap;
+static size_t leasehead;
+static size_t leasecount;
+static uint64_t leaseexp[MAX_SHARED_PAGES];
+static pthread_t tlease;
+
 // Check if the address (addr) is in a shared memory range.
 // The address is in a shared memory page if it is in the same page as any
 // address in the range [start, start + len).
@@ -54,10 +135,143 @@ int sharedaddr(void *addr) {
   return 0;
 }
 
-// Intercept a pagefault for pages that are:
+// Return the always-writable alias of page pg, or NULL if its region has none.
+// The RPC layer moves page data in and out through this alias, so the pages
+// the application sees never need to be opened up to do it.
+void *shadowpage(void *pg) {
+  int i;
+  uintptr_t uaddr = (uintptr_t)pg;
+  for (i = 0; i < nextshrp; i++) {
+    if (shrp[i].shadow && (uaddr >= shrp[i].start) &&
+        (uaddr < shrp[i].start + PGADDR(shrp[i].len + PG_SIZE - 1))) {
+      return (void *)(shrp[i].shadow + (uaddr - shrp[i].start));
+    }
+  }
+  return NULL;
+}
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start a lease of ms milliseconds on page pgnum, which was just granted for
+// reading. The lease runs from since_us, when the page was asked for: the
+// manager starts its own later, as it sends the grant, so the node's copy is
+// dropped before the manager lets a writer in however long the grant took to
+// arrive. Called with faultm held.
+void grantlease(int pgnum, int ms, uint64_t since_us) {
+  uint64_t expiry = since_us + (uint64_t)ms * 1000;
+  leaseexp[pgnum % MAX_SHARED_PAGES] = expiry;
+
+  pthread_mutex_lock(&leasem);
+  if (leasecount == leasecap) {
+    // Grow the ring, unwrapping it into the new buffer.
+    size_t cap = leasecap ? leasecap * 2 : 1024;
+    struct lease *l = malloc(cap * sizeof(struct lease));
+    if (l == NULL) {
+      err(1, "Could not grow the lease queue");
+    }
+    size_t i;
+    for (i = 0; i < leasecount; i++) {
+      l[i] = leases[(leasehead + i) % leasecap];
+    }
+    free(leases);
+    leases = l;
+    leasecap = cap;
+    leasehead = 0;
+  }
+  // Grants can arrive out of the order they were asked for, so the lease is
+  // moved back past any that run out later; that is rarely more than a few.
+  size_t i = leasecount;
+  while (i > 0 && leases[(leasehead + i - 1) % leasecap].expiry_us > expiry) {
+    leases[(leasehead + i) % leasecap] = leases[(leasehead + i - 1) % leasecap];
+    i--;
+  }
+  struct lease l = {pgnum, expiry};
+  leases[(leasehead + i) % leasecap] = l;
+  leasecount++;
+  pthread_cond_signal(&leasec);
+  pthread_mutex_unlock(&leasem);
+}
+
+// Forget the lease on page pgnum, which is now held for writing. Called with
+// faultm held.
+void cancellease(int pgnum) {
+  leaseexp[pgnum % MAX_SHARED_PAGES] = 0;
+}
+
+// Drop read copies as their leases run out. The manager waits a little past
+// each lease before letting anyone write the page.
+static void *leasereaper(void *ptr) {
+  pthread_mutex_lock(&leasem);
+  while (1) {
+    if (leasecount == 0) {
+      pthread_cond_wait(&leasec, &leasem);
+      continue;
+    }
+    struct lease l = leases[leasehead];
+    if (l.expiry_us > monotonic_us()) {
+      struct timespec ts = {
+        .tv_sec = l.expiry_us / 1000000,
+        .tv_nsec = (l.expiry_us % 1000000) * 1000,
+      };
+      pthread_cond_timedwait(&leasec, &leasem, &ts);
+      continue;
+    }
+    leasehead = (leasehead + 1) % leasecap;
+    leasecount--;
+    pthread_mutex_unlock(&leasem);
+
+    pthread_mutex_lock(&faultm);
+    if (leaseexp[l.pgnum % MAX_SHARED_PAGES] == l.expiry_us) {
+      leaseexp[l.pgnum % MAX_SHARED_PAGES] = 0;
+      void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)l.pgnum);
+      if (mprotect(pg, PG_SIZE, PROT_NONE) != 0) {
+        fprintf(stderr, "Dropping leased page addr %p failed\n", pg);
+      }
+    }
+    pthread_mutex_unlock(&faultm);
+
+    pthread_mutex_lock(&leasem);
+  }
+  return NULL;
+}
+
+static uint64_t wallclock_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void futexwait(uint32_t *addr, uint32_t val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futexwake(uint32_t *addr, int n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Post a fault for the fault-service thread. Lock-free, so the signal handler
+// can call it.
+static void postfault(struct faultreq *req) {
+  req->next = __atomic_load_n(&faultq, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&faultq, &req->next, req, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  __atomic_fetch_add(&faultseq, 1, __ATOMIC_RELEASE);
+  futexwake(&faultseq, 1);
+}
+
+// Intercept a pagefault for pages that are in a shared region, and sleep until
+// the fault-service thread and the listener have installed the page. Only
+// async-signal-safe calls are made here.
 // Any other faults should be forwarded to the default handler.
 void pgfaultsh(int sig, siginfo_t *info, ucontext_t *ctx) {
-  void *pgaddr;
+  static const char notshared[] =
+      "SEGFAULT not in shared memory region, reverting to old handler\n";
+  int saved = errno;
 
   // Ignore signals that are not segfaults.
   if (sig != SIGSEGV) {
@@ -66,139 +280,405 @@ void pgfaultsh(int sig, siginfo_t *info, ucontext_t *ctx) {
 
   // Only handle faults in the shared memory region. 
   if (! sharedaddr(info->si_addr)) {
-    printf("SEGFAULT not in shared memory region (was at %p)... ignoring.\n", (void *)info->si_addr);
-    printf("reverting to old handler\n");
+    write(STDERR_FILENO, notshared, sizeof(notshared) - 1);
     (oldact.sa_handler)(sig);
   }
 
-  // Dispatch fault to a read or write handler.
-  pgaddr = (void *)PGADDR((uintptr_t) info->si_addr);
-  if (ctx->uc_mcontext.gregs[REG_ERR] & PG_WRITE) {
-    if (writehandler(pgaddr) < 0) {
-      fprintf(stderr, "writehandler failed\n");
-      exit(1);
-    }
-  } else {
-    if (readhandler(pgaddr) < 0) {
-      fprintf(stderr, "readhandler failed\n");
-      exit(1);
+  struct faultreq req = {
+    .pgnum = PGADDR_TO_PGNUM((uintptr_t)info->si_addr),
+    .write = (ctx->uc_mcontext.gregs[REG_ERR] & PG_WRITE) != 0,
+    .start_us = wallclock_us(),
+    .done = 0,
+  };
+  postfault(&req);
+  while (__atomic_load_n(&req.done, __ATOMIC_ACQUIRE) == 0) {
+    futexwait(&req.done, 0);
+  }
+
+  __atomic_fetch_add(req.write ? &wfcnt : &rfcnt, 1, __ATOMIC_RELAXED);
+  errno = saved;
+}
+
+// Return the fetch in flight for page pgnum, or NULL. Called with faultm held.
+static struct fetch *findfetch(int pgnum) {
+  struct fetch *f;
+  for (f = fetches; f != NULL; f = f->next) {
+    if (f->pgnum == pgnum) {
+      return f;
     }
   }
-  return;
+  return NULL;
 }
 
-// Connect to manager, etc.
-// pg should be page-aligned.
-// Return 0 on success.
-int writehandler(void *pg) { 
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  double start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-
-  int pgnum = PGADDR_TO_PGNUM((uintptr_t) pg);
-  pthread_mutex_lock(&waitm[pgnum % MAX_SHARED_PAGES]); // Need to lock to use our condition variable.
-
-  gettimeofday(&tv, NULL);
-  double end_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  
-  if (requestpage(pgnum, "WRITE") != 0) {
-    pthread_mutex_unlock(&waitm[pgnum % MAX_SHARED_PAGES]);
-    return -1;
+// Return when page pgnum was asked for, or 0 if it was not. Called with faultm
+// held.
+uint64_t requestsent(int pgnum) {
+  struct fetch *f = findfetch(pgnum);
+  return f != NULL ? f->sent_us : 0;
+}
+
+// Take every fault posted since the last round and ask the manager for their
+// pages in one message. A fault on a page that is already being fetched waits
+// for that fetch; if it needed more access than the fetch brings, it simply
+// faults again.
+static void *faultservice(void *ptr) {
+  while (1) {
+    uint32_t seq = __atomic_load_n(&faultseq, __ATOMIC_ACQUIRE);
+    struct faultreq *posted = __atomic_exchange_n(&faultq, NULL,
+                                                  __ATOMIC_ACQUIRE);
+    if (posted == NULL) {
+      futexwait(&faultseq, seq);
+      continue;
+    }
+
+    // The queue is a stack; reverse it to serve faults in the order they came.
+    struct faultreq *reqs = NULL;
+    int n = 0;
+    while (posted != NULL) {
+      struct faultreq *req = posted;
+      posted = req->next;
+      req->next = reqs;
+      reqs = req;
+      n++;
+    }
+
+    int *pgnums = malloc(n * sizeof(int));
+    int *writes = malloc(n * sizeof(int));
+    if (pgnums == NULL || writes == NULL) {
+      err(1, "Could not queue page requests");
+    }
+    int nreq = 0;
+
+    // Register the fetches before asking, so the listener finds them however
+    // fast the grants come back.
+    uint64_t sent = monotonic_us();
+    pthread_mutex_lock(&faultm);
+    while (reqs != NULL) {
+      struct faultreq *req = reqs;
+      reqs = req->next;
+      struct fetch *f = findfetch(req->pgnum);
+      if (f == NULL) {
+        if ((f = malloc(sizeof(struct fetch))) == NULL) {
+          err(1, "Could not queue page requests");
+        }
+        f->pgnum = req->pgnum;
+        f->sent_us = sent;
+        f->waiters = NULL;
+        f->next = fetches;
+        fetches = f;
+        pgnums[nreq] = req->pgnum;
+        writes[nreq] = req->write;
+        nreq++;
+      }
+      req->next = f->waiters;
+      f->waiters = req;
+    }
+    pthread_mutex_unlock(&faultm);
+
+    if (nreq > 0 && requestpages(pgnums, writes, nreq) != 0) {
+      errx(1, "Could not request pages");
+    }
+    free(pgnums);
+    free(writes);
   }
+  return NULL;
+}
 
-  gettimeofday(&tv, NULL);
-  end_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
+// Wake the faults waiting for page pgnum, which has just been installed.
+// Called by the listener with faultm held.
+void completefault(int pgnum) {
+  struct fetch **fp;
+  for (fp = &fetches; *fp != NULL; fp = &(*fp)->next) {
+    if ((*fp)->pgnum == pgnum) {
+      break;
+    }
+  }
+  struct fetch *f = *fp;
+  if (f == NULL) {
+    return;
+  }
+  *fp = f->next;
+
+  uint64_t end_us = wallclock_us();
+  struct faultreq *req = f->waiters;
+  while (req != NULL) {
+    // The request lives on the faulting thread's stack, so it must not be
+    // touched once done is set.
+    struct faultreq *next = req->next;
+    tracefault(req->pgnum, req->write ? TRACE_WRITE : TRACE_READ,
+               req->start_us, end_us);
+    __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+    futexwake(&req->done, 1);
+    req = next;
+  }
+  free(f);
+}
 
-  pthread_cond_wait(&waitc[pgnum % MAX_SHARED_PAGES],
-    &waitm[pgnum % MAX_SHARED_PAGES]); // Wait for page message from server.
-  
-  gettimeofday(&tv, NULL);
-  end_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-     
-  pthread_mutex_unlock(&waitm[pgnum % MAX_SHARED_PAGES]); // Unlock, allow another handler to run.
+// Wait until nodes nodes (this one included) have called dsm_barrier.
+// Return 0 on success.
+int dsm_barrier(int nodes) {
+  int gen;
 
-  wfcnt++;
+  pthread_mutex_lock(&barrierm);
+  gen = barriergen;
+  if (requestbarrier(nodes) != 0) {
+    pthread_mutex_unlock(&barrierm);
+    return -1;
+  }
+  while (barriergen == gen) {
+    pthread_cond_wait(&barrierc, &barrierm);
+  }
+  pthread_mutex_unlock(&barrierm);
   return 0;
 }
 
-// Connect to manager, etc.
-// pg should be page-aligned.
+// Ask the manager to write an image of the shared pages to path, on the
+// manager's machine, and wait until it has.
 // Return 0 on success.
-int readhandler(void *pg) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  double start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
+int dsm_checkpoint(const char *path) {
+  int gen;
 
-  int pgnum = PGADDR_TO_PGNUM((uintptr_t) pg);
-  pthread_mutex_lock(&waitm[pgnum % MAX_SHARED_PAGES]); // Need to lock to use our condition variable.
+  pthread_mutex_lock(&checkpointm);
+  gen = checkpointgen;
+  if (requestcheckpoint(path) != 0) {
+    pthread_mutex_unlock(&checkpointm);
+    return -1;
+  }
+  while (checkpointgen == gen) {
+    pthread_cond_wait(&checkpointc, &checkpointm);
+  }
+  int ok = checkpointok;
+  pthread_mutex_unlock(&checkpointm);
+  return ok ? 0 : -1;
+}
 
-  gettimeofday(&tv, NULL);
-  double end_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
+// Copy the n accepted pages of the pending warm start batch into their
+// shadows and open them for reading, a run of consecutive pages at a time,
+// then wake the thread that offered them. Called by the listener with the
+// manager's reply.
+void completewarmstart(int *pgnums, int n, int leasems) {
+  int i, j;
+
+  pthread_mutex_lock(&warmm);
+  struct warmbatch *b = warmpending;
+  if (b == NULL) {
+    fprintf(stderr, "Unexpected reply to WARMSTART.\n");
+    pthread_mutex_unlock(&warmm);
+    return;
+  }
 
-  if (requestpage(pgnum, "READ") != 0) {
-    pthread_mutex_unlock(&waitm[pgnum % MAX_SHARED_PAGES]);
-    return -1;
+  uintptr_t runstart = 0;
+  size_t runlen = 0;
+  for (i = 0, j = 0; i < n; i++) {
+    // Accepted pages come back in the order they were offered.
+    while (j < b->n && b->entries[b->idx[j]].pgnum != (uint32_t)pgnums[i]) {
+      j++;
+    }
+    if (j == b->n) {
+      fprintf(stderr, "Page %d was never offered for warm start.\n", pgnums[i]);
+      break;
+    }
+    void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)pgnums[i]);
+    memcpy(shadowpage(pg), b->image + b->dataoff + (size_t)b->idx[j] * PG_SIZE,
+           PG_SIZE);
+    b->installed++;
+    if (leasems > 0) {
+      pthread_mutex_lock(&faultm);
+      grantlease(pgnums[i], leasems, b->sent_us);
+      pthread_mutex_unlock(&faultm);
+    }
+
+    if (runlen > 0 && (uintptr_t)pg == runstart + runlen * PG_SIZE) {
+      runlen++;
+      continue;
+    }
+    if (runlen > 0) {
+      mprotect((void *)runstart, runlen * PG_SIZE, PROT_READ);
+    }
+    runstart = (uintptr_t)pg;
+    runlen = 1;
   }
+  if (runlen > 0) {
+    mprotect((void *)runstart, runlen * PG_SIZE, PROT_READ);
+  }
+
+  warmgen++;
+  pthread_cond_broadcast(&warmc);
+  pthread_mutex_unlock(&warmm);
+}
 
-  gettimeofday(&tv, NULL);
-  end_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
+// Offer the n pages listed in idx, entries of the image mapped at image, to
+// the manager as read copies, and wait until the listener has installed the
+// ones it accepted.
+// Return the number of pages installed.
+static int warmbatch(const char *image, const struct imageentry *entries,
+                     size_t dataoff, int *idx, int n) {
+  int pgnums[WARM_BATCH];
+  struct warmbatch b = {
+    .image = image,
+    .entries = entries,
+    .dataoff = dataoff,
+    .idx = idx,
+    .n = n,
+    .sent_us = monotonic_us(),
+    .installed = 0,
+  };
+  int i;
 
-  pthread_cond_wait(&waitc[pgnum % MAX_SHARED_PAGES],
-    &waitm[pgnum % MAX_SHARED_PAGES]); // Wait for page message from server.
+  for (i = 0; i < n; i++) {
+    pgnums[i] = entries[idx[i]].pgnum;
+  }
 
-  gettimeofday(&tv, NULL);
-  end_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
-  start_us = (tv.tv_sec) * 1000000 + (tv.tv_usec);
+  pthread_mutex_lock(&warmm);
+  int gen = warmgen;
+  warmpending = &b;
+  if (requestwarmstart(pgnums, n) == 0) {
+    while (warmgen == gen) {
+      pthread_cond_wait(&warmc, &warmm);
+    }
+  }
+  warmpending = NULL;
+  pthread_mutex_unlock(&warmm);
+  return b.installed;
+}
 
-  pthread_mutex_unlock(&waitm[pgnum % MAX_SHARED_PAGES]); // Unlock, allow another handler to run.
-  
-  rfcnt++;
-  return 0;
+// Rebuild this node's read copies from the image at path, which the manager
+// wrote with dsm_checkpoint and was restarted from (manager.py --image). Only
+// pages this node held at the checkpoint and the manager still has unchanged
+// are installed; everything else faults in as usual.
+// Return the number of pages installed, or -1.
+static int warmstart(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open image %s.\n", path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct imageheader)) {
+    fprintf(stderr, "Could not read image %s.\n", path);
+    close(fd);
+    return -1;
+  }
+  char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "mmap of image %s failed.\n", path);
+    return -1;
+  }
+
+  const struct imageheader *h = (const struct imageheader *)image;
+  size_t dataoff = imagedataoffset(h->npages, PG_SIZE);
+  if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != IMAGE_VERSION || h->pagesize != PG_SIZE ||
+      dataoff + (size_t)h->npages * PG_SIZE > (size_t)st.st_size) {
+    fprintf(stderr, "%s is not a DSM image.\n", path);
+    munmap(image, st.st_size);
+    return -1;
+  }
+  const struct imageentry *entries =
+      (const struct imageentry *)(image + sizeof(struct imageheader));
+
+  int installed = 0;
+  int held = 0;
+  if (id >= 1 && id <= IMAGE_MAX_NODES) {
+    int idx[WARM_BATCH];
+    int n = 0;
+    uint32_t i;
+    for (i = 0; i < h->npages; i++) {
+      void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)entries[i].pgnum);
+      if (!(entries[i].holders & (1ULL << (id - 1))) || shadowpage(pg) == NULL) {
+        continue;
+      }
+      held++;
+      idx[n++] = i;
+      if (n == WARM_BATCH) {
+        installed += warmbatch(image, entries, dataoff, idx, n);
+        n = 0;
+      }
+    }
+    if (n > 0) {
+      installed += warmbatch(image, entries, dataoff, idx, n);
+    }
+  }
+
+  printf("warm start: installed %d of %d pages held at the checkpoint\n",
+         installed, held);
+  munmap(image, st.st_size);
+  return installed;
 }
 
+// Zero-initialized regions are backed by a memory file that is mapped twice:
+// once at start for the application, whose protections track the coherence
+// state, and once elsewhere read-write as the region's shadow. Page data is
+// received into and sent from the shadow directly.
 int addsharedregion(uintptr_t start, size_t len, int policy) {
+  uintptr_t shadow = 0;
+
   if (nextshrp >= MAX_SHARED_PAGES) {
     return -1;
   }
 
   if (policy & SHRPOL_INIT_ZERO) {
-    int zero_fd = open("/dev/zero", O_RDONLY, 0644);
-    void *p = mmap((void *)start, len, (PROT_NONE),
-                   (MAP_ANON|MAP_PRIVATE), zero_fd, 0);
-    if ((p < 0) || (p == NULL)) {
+    size_t size = PGADDR(len + PG_SIZE - 1);
+    int fd = memfd_create("libdsmu", 0);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+      fprintf(stderr, "Could not create region memory file.\n");
+      return -1;
+    }
+    void *p = mmap((void *)start, size, (PROT_NONE), MAP_SHARED, fd, 0);
+    if ((p == MAP_FAILED) || (p != (void *)start)) {
       fprintf(stderr, "mmap failed.\n");
+      close(fd);
       return -1;
     }
+    void *s = mmap(NULL, size, (PROT_READ|PROT_WRITE), MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+      fprintf(stderr, "mmap of shadow region failed.\n");
+      return -1;
+    }
+    shadow = (uintptr_t)s;
   } else {
     if ((mprotect((void *)start, PGADDR(len + PG_SIZE), PROT_NONE)) != 0) {
       return -1;
     }
   }
 
-  struct sharedregion r = {start, len, policy};
+  struct sharedregion r = {start, len, policy, shadow};
   shrp[nextshrp] = r;
   nextshrp++;
   return 0;
 }
 
+// Set DSM_TRACE to a file path to record every fault of this node there; see
+// manager/replay.py. Set DSM_WARM_START to an image written by dsm_checkpoint
+// to start with the read copies this node held then, if the program does not
+// name one with initlibdsmuwarm.
+int initlibdsmu(char *ip, int port, uintptr_t starta, size_t len) {
+  return initlibdsmuwarm(ip, port, starta, len, getenv("DSM_WARM_START"));
+}
+
 // Test the page fault handler.
 // Register the handler, setup a non-readable, non-writeable memory region.
 // Try to read from it -- expect handler to run and make it readable.
 // Try to write from it -- expect handler to run and make it writeable.
 // Try to derefence NULL pointer -- expect handler to forward segfault to the
 // default handler, which should terminate the program.
-int initlibdsmu(char *ip, int port, uintptr_t starta, size_t len) {
+int initlibdsmuwarm(char *ip, int port, uintptr_t starta, size_t len,
+                    const char *image) {
   int i;
   struct sigaction sa;
 
   rfcnt = 0;
   wfcnt = 0;
 
+  // Start the optional fault trace before any fault can happen.
+  if (getenv("DSM_TRACE") != NULL) {
+    if (inittrace(getenv("DSM_TRACE"), id) < 0) {
+      return -1;
+    }
+  }
+
   // Register page fault handler.
   sa.sa_sigaction = (void *)pgfaultsh;
   sigemptyset(&sa.sa_mask);
@@ -207,12 +687,12 @@ int initlibdsmu(char *ip, int port, uintptr_t starta, size_t len) {
     fprintf(stderr, "sigaction failed\n");
   }
 
-  // Make condition variables/mutexes for each page.
-  for (i = 0; i < MAX_SHARED_PAGES; i++) {
-    pthread_condattr_init(&waitca[i]);
-    pthread_cond_init(&waitc[i], &waitca[i]);
-    pthread_mutex_init(&waitm[i], NULL);
-  }
+  // Lease expiries are on the monotonic clock.
+  pthread_condattr_t leaseca;
+  pthread_condattr_init(&leaseca);
+  pthread_condattr_setclock(&leaseca, CLOCK_MONOTONIC);
+  pthread_cond_init(&leasec, &leaseca);
+  pthread_condattr_destroy(&leaseca);
 
   // Setup shared regions.
   nextshrp = 0;
@@ -221,6 +701,7 @@ int initlibdsmu(char *ip, int port, uintptr_t starta, size_t len) {
       .start = 0,
       .len = 0,
       .policy = 0,
+      .shadow = 0,
     };
     shrp[i] = z;
   }
@@ -239,20 +720,30 @@ int initlibdsmu(char *ip, int port, uintptr_t starta, size_t len) {
     return -1;
   }
 
-  return 0;
-}
+  // Reinstall pages from a checkpoint. Replies and invalidations of pages
+  // already granted both go through the listener, in the order they were sent.
+  if (image != NULL) {
+    warmstart(image);
+  }
 
-int teardownlibdsmu(void) {
-  int i;
+  // One that sends the page requests of faulting threads.
+  if ((pthread_create(&tfault, NULL, faultservice, NULL) != 0)) {
+    fprintf(stderr, "failed to spawn fault-service thread\n");
+    return -1;
+  }
 
-  // Clear condition variables/mutexes for each page.
-  for (i = 0; i < MAX_SHARED_PAGES; i++) {
-    pthread_condattr_destroy(&waitca[i]);
-    pthread_cond_destroy(&waitc[i]);
-    pthread_mutex_destroy(&waitm[i]);
+  // And one that drops read copies whose leases have run out.
+  if ((pthread_create(&tlease, NULL, leasereaper, NULL) != 0)) {
+    fprintf(stderr, "failed to spawn lease thread\n");
+    return -1;
   }
 
+  return 0;
+}
+
+int teardownlibdsmu(void) {
   teardownsocks();
+  teardowntrace();
 
   return 0;
 }
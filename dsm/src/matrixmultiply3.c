@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libdsmu.h"
+#include "mem.h"
+
+// C is stored as TILE x TILE tiles of ints, and each tile fills exactly one
+// page, so a page is only ever written by the node that owns its tile. A and B
+// are private to every node, as in matrixmultiply.
+#define TILE 32
+#define NTILES 30
+#define SIZE (TILE * NTILES)
+#define SEED 69
+
+typedef int matrix_t [SIZE][SIZE];
+typedef int tile_t [TILE][TILE];
+
+int id;
+
+int randint() {
+  return rand() % 10;
+}
+
+matrix_t A, B;
+
+// Serial multiply from test/matrix_mult.c.
+void matrix_mult(int n, const int *a, const int *b, int *c);
+
+// Compute tile (ti, tj) of A * B into out. The k loop is blocked by TILE so the
+// rows of B it walks stay in cache, and the innermost loop runs along a row of
+// B and of the tile with unit stride, which the compiler vectorizes.
+void multiply_tile(int ti, int tj, tile_t out) {
+  int i, j, k, kk;
+  memset(out, 0, sizeof(tile_t));
+  for (kk = 0; kk < SIZE; kk += TILE) {
+    for (i = 0; i < TILE; i++) {
+      const int *arow = &A[ti * TILE + i][kk];
+      int *crow = out[i];
+      for (k = 0; k < TILE; k++) {
+        const int a = arow[k];
+        const int *brow = &B[kk + k][tj * TILE];
+        for (j = 0; j < TILE; j++) {
+          crow[j] += a * brow[j];
+        }
+      }
+    }
+  }
+}
+
+// Compare the shared tiles against the serial reference. Reading every tile
+// pulls the other nodes' pages over the DSM.
+int verify(tile_t *C) {
+  int i, j;
+  int *expect = calloc(SIZE * SIZE, sizeof(int));
+  if (expect == NULL) {
+    fprintf(stderr, "calloc failed.\n");
+    return -1;
+  }
+  matrix_mult(SIZE, &A[0][0], &B[0][0], expect);
+
+  int bad = 0;
+  for (i = 0; i < SIZE; i++) {
+    for (j = 0; j < SIZE; j++) {
+      int got = C[(i / TILE) * NTILES + j / TILE][i % TILE][j % TILE];
+      if (got != expect[i * SIZE + j]) {
+        if (bad < 10) {
+          printf("C[%d][%d] = %d, expected %d\n", i, j, got, expect[i * SIZE + j]);
+        }
+        bad++;
+      }
+    }
+  }
+  free(expect);
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 5) {
+    printf("Usage: main MANAGER_IP MANAGER_PORT id[1|2|...|n] nodes[n]\n");
+    return 1;
+  }
+
+  srand(SEED);
+
+  char *ip = argv[1];
+  int port = atoi(argv[2]);
+  id = atoi(argv[3]);
+  int n = atoi(argv[4]);
+
+  initlibdsmu(ip, port, 0x12340000, 4096 * 10000);
+
+  tile_t *C = (tile_t *) 0x12340000;
+
+  int i, j;
+  for (i = 0; i < SIZE; i++) {
+    for (j = 0; j < SIZE; j++) {
+      A[i][j] = randint();
+      B[i][j] = randint();
+    }
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  double start_ms = (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000;
+
+  // Tiles are handed out to nodes in contiguous chunks. Each is computed in a
+  // private buffer and copied out whole, so every shared page takes a single
+  // write fault.
+  int first = (id - 1) * (NTILES * NTILES) / n;
+  int last = id * (NTILES * NTILES) / n;
+  int t;
+  tile_t out;
+  for (t = first; t < last; t++) {
+    multiply_tile(t / NTILES, t % NTILES, out);
+    memcpy(C[t], out, sizeof(tile_t));
+  }
+
+  gettimeofday(&tv, NULL);
+  double compute_ms = (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000;
+
+  dsm_barrier(n);
+
+  gettimeofday(&tv, NULL);
+  double end_ms = (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000;
+
+  printf("Processor id %d did %d tiles\n", id, last - first);
+  printf("COMPUTE TIME (ms): %lf\n", (compute_ms - start_ms));
+  printf("TOTAL TIME (ms): %lf\n", (end_ms - start_ms));
+
+  // Node 1 checks the whole result while the others wait, since they must stay
+  // connected to hand over their pages.
+  int ret = 0;
+  if (id == 1) {
+    int bad = verify(C);
+    if (bad == 0) {
+      printf("verify: OK\n");
+    } else {
+      printf("verify: %d wrong entries\n", bad);
+      ret = 1;
+    }
+  }
+  dsm_barrier(n);
+  printf("done\n");
+
+  teardownlibdsmu();
+  return ret;
+}
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "mem.h"
+#include "pagecomp.h"
+
+#define WORDS_PER_PAGE (PG_SIZE / 4)
+
+// Bytes stored for a word with each tag.
+static const int tagbytes[4] = {0, 1, 2, 4};
+
+static inline int wordtag(uint32_t w) {
+  if (w == 0)
+    return 0;
+  if (w < (1 << 8))
+    return 1;
+  if (w < (1 << 16))
+    return 2;
+  return 3;
+}
+
+int compresspage(const void *pg, void *out) {
+  const uint32_t *words = pg;
+  uint8_t *tags = out;
+  uint8_t *p = tags + PAGECOMP_TAG_BYTES;
+  uint8_t *end = tags + PG_SIZE;
+  int i;
+
+  memset(tags, 0, PAGECOMP_TAG_BYTES);
+  for (i = 0; i < WORDS_PER_PAGE; i++) {
+    uint32_t w = words[i];
+    int tag = wordtag(w);
+    // Give up as soon as the output could not come out smaller than the page.
+    if (p + tagbytes[tag] >= end)
+      return -1;
+    tags[i / 4] |= tag << ((i % 4) * 2);
+    memcpy(p, &w, tagbytes[tag]);  // Little-endian: low bytes first.
+    p += tagbytes[tag];
+  }
+  return p - tags;
+}
+
+int decompresspage(const void *in, size_t len, void *pg) {
+  const uint8_t *tags = in;
+  const uint8_t *p = tags + PAGECOMP_TAG_BYTES;
+  const uint8_t *end = tags + len;
+  uint32_t *words = pg;
+  int i;
+
+  if (len < PAGECOMP_TAG_BYTES)
+    return -1;
+  for (i = 0; i < WORDS_PER_PAGE; i++) {
+    int n = tagbytes[(tags[i / 4] >> ((i % 4) * 2)) & 3];
+    uint32_t w = 0;
+    if (p + n > end)
+      return -1;
+    memcpy(&w, p, n);
+    words[i] = w;
+    p += n;
+  }
+  return (p == end) ? 0 : -1;
+}
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE  // memmem
+
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -7,12 +10,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#include "b64.h"
+#include "libdsmu.h"
 #include "mem.h"
+#include "pagecomp.h"
 #include "rpc.h"
 
+// Page data travels raw after this marker, which ends the text of a message.
+#define PAGEDATA " PAGEDATA "
+// Compressed page data (see pagecomp.h) travels after this one instead.
+#define PAGEZ " PAGEZ "
+// Longest message text that can come before PAGEDATA.
+#define MAX_TEXT_LEN 128
+
 // Socket state.
 int serverfd;
 struct addrinfo *resolvedAddr;
@@ -20,49 +33,152 @@ struct addrinfo hints;
 
 pthread_mutex_t sockl;
 
-extern pthread_condattr_t waitca[MAX_SHARED_PAGES];
-extern pthread_cond_t waitc[MAX_SHARED_PAGES];
-extern pthread_mutex_t waitm[MAX_SHARED_PAGES];
+extern pthread_mutex_t faultm;
+
+extern pthread_mutex_t barrierm;
+extern pthread_cond_t barrierc;
+extern int barriergen;
+
+extern pthread_mutex_t checkpointm;
+extern pthread_cond_t checkpointc;
+extern int checkpointgen;
+extern int checkpointok;
+
+extern int id;
+
+// Where page data goes when a page has no shadow to receive it in place.
+static char staging[PG_SIZE] __attribute__((aligned(PG_SIZE)));
+
+// Compression state, negotiated with the manager in initsocks. Only the
+// listener thread sends and receives page data, so zbuf needs no lock.
+// After COMP_GIVEUP pages in a row fail to shrink, the next COMP_SKIP pages go
+// out raw without trying.
+#define COMP_GIVEUP 8
+#define COMP_SKIP 64
+static int compressing;
+static char zbuf[PG_SIZE];
+static int compfailures;
+static int compskip;
+
+static struct compstats {
+  long sentpages;   // Pages sent.
+  long sentzpages;  // Pages sent compressed.
+  long sentbytes;   // Page bytes on the wire, compressed or not.
+  long recvpages;
+  long recvzpages;
+  long recvbytes;
+} cstats;
+
+// Receive exactly len bytes into buf.
+static void recvall(void *buf, size_t len, const char *what) {
+  ssize_t ret = recv(serverfd, buf, len, MSG_WAITALL);
+  if (ret != len)
+    err(1, "Could not read %s from socket", what);
+}
+
+// Peek at the length header of the next message. Return the length of the
+// text after it and store the size of the header itself in headerlen.
+static int peekheader(int *headerlen) {
+  // See how long the payload (actualy message) is by peeking.
+  // Messages can be shorter than the peek, so peek until the space after the
+  // length has arrived rather than waiting for a fixed number of bytes.
+  char peekstr[20] = {0};
+  int ret;
+  do {
+    ret = recv(serverfd, peekstr, 10, MSG_PEEK);
+    if (ret <= 0)
+      err(1, "Could not peek into next packet's size");
+  } while (memchr(peekstr, ' ', ret) == NULL);
+
+  // Compute size of header (the length string).
+  char *p = peekstr;
+  for (*headerlen = 1; *p != ' '; p++)
+    (*headerlen)++;
+  return atoi(peekstr);
+}
 
 // Listen for manager messages and dispatch them.
+// A message is "<len> <text>" where text may end in PAGEDATA followed by a
+// raw page. The text is read into a small buffer and the page straight into
+// its shadow (or the staging page), so page data is never copied on the way in.
 void *listenman(void *ptr) {
   int ret;
   printf("Listening...\n");
   while (1) {
-    // See how long the payload (actualy message) is by peeking.
-    char peekstr[20] = {0};
-    ret = recv(serverfd, peekstr, 10, MSG_PEEK | MSG_WAITALL);
-    if (ret != 10)
-      err(1, "Could not peek into next packet's size");
-    int payloadlen = atoi(peekstr);
-
-    // Compute size of header (the length string).
     int headerlen;
-    char *p = peekstr;
-    for (headerlen = 1; *p != ' '; p++)
-      headerlen++;
+    int payloadlen = peekheader(&headerlen);
 
-    // Read the entire unit (header + payload) from the socket.
+    // Peek at the start of the text to see whether page data follows it.
     char msg[10000] = {0};
-    ret = recv(serverfd, msg, headerlen + payloadlen, MSG_WAITALL);
-    if (ret != headerlen + payloadlen)
-      err(1, "Could not read entire unit from socket");
+    int peeklen = headerlen + (payloadlen < MAX_TEXT_LEN ? payloadlen : MAX_TEXT_LEN);
+    ret = recv(serverfd, msg, peeklen, MSG_PEEK | MSG_WAITALL);
+    if (ret != peeklen)
+      err(1, "Could not peek into message text");
+    char *marker = memmem(msg, peeklen, PAGEDATA, strlen(PAGEDATA));
+    char *zmarker = memmem(msg, peeklen, PAGEZ, strlen(PAGEZ));
+    int zipped = 0;
+    if (zmarker != NULL && (marker == NULL || zmarker < marker)) {
+      marker = zmarker;
+      zipped = 1;
+    }
 
-    const char s[] = " ";
-    char *payload = strstr(msg, s) + 1;
-    dispatch(payload);
+    if (marker == NULL) {
+      // Read the entire unit (header + payload) from the socket.
+      memset(msg, 0, peeklen);
+      recvall(msg, headerlen + payloadlen, "entire unit");
+      dispatch(msg + headerlen, NULL);
+      continue;
+    }
+
+    // Read the text, then the page right behind it. A compressed page is
+    // read into zbuf and expanded straight into place.
+    int textlen = marker - msg + strlen(zipped ? PAGEZ : PAGEDATA);
+    int datalen = headerlen + payloadlen - textlen;
+    if ((zipped && (datalen <= 0 || datalen >= PG_SIZE)) ||
+        (!zipped && datalen != PG_SIZE))
+      errx(1, "Malformed page message");
+    memset(msg, 0, peeklen);
+    recvall(msg, textlen, "message text");
+
+    char *spgnum = strstr(msg, "ION ") + 4;
+    void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)atoi(spgnum));
+    void *data = shadowpage(pg);
+    if (data == NULL) {
+      data = staging;
+    }
+    if (zipped) {
+      recvall(zbuf, datalen, "compressed page data");
+      if (decompresspage(zbuf, datalen, data) != 0)
+        errx(1, "Corrupt compressed page %d", atoi(spgnum));
+      cstats.recvzpages++;
+    } else {
+      recvall(data, PG_SIZE, "page data");
+    }
+    cstats.recvpages++;
+    cstats.recvbytes += datalen;
+    dispatch(msg + headerlen, data);
   }
 }
 
-// Handle newly arrived messages.
-int dispatch(char *msg) {
+// Handle newly arrived messages. data is the page that came with the message,
+// or NULL.
+int dispatch(char *msg, void *data) {
 #ifdef DEBUG
   printf("< %.40s\n", msg);
 #endif  // DEBUG
-  if (strstr(msg, "INVALIDATE") != NULL) {
+  if (strncmp(msg, "INVALIDATEBATCH", strlen("INVALIDATEBATCH")) == 0) {
+    invalidatebatch(msg);
+  } else if (strstr(msg, "INVALIDATE") != NULL) {
     invalidate(msg);
   } else if (strstr(msg, "REQUESTPAGE") != NULL) {
-    handleconfirm(msg);
+    handleconfirm(msg, data);
+  } else if (strncmp(msg, "BARRIER", strlen("BARRIER")) == 0) {
+    handlebarrier(msg);
+  } else if (strncmp(msg, "CHECKPOINT", strlen("CHECKPOINT")) == 0) {
+    handlecheckpoint(msg);
+  } else if (strncmp(msg, "WARMSTART CONFIRMATION",
+                     strlen("WARMSTART CONFIRMATION")) == 0) {
+    handlewarmstart(msg);
   } else {
     printf("Undefined message.\n");
   }
@@ -71,18 +187,54 @@ int dispatch(char *msg) {
 
 // Send a message to the manager.
 int sendman(char *str) {
-  int ret;
+  return sendmandata(str, NULL, 0);
+}
+
+// Send a message followed by len bytes of page data to the manager.
+// The length header, the text and the data go out as one vectored write
+// straight from where they live.
+int sendmandata(char *str, const void *data, size_t len) {
+  char header[24];
+  struct iovec iov[3];
+  struct msghdr mh;
+  size_t textlen = strlen(str);
+  size_t left;
+  ssize_t ret;
 
 #ifdef DEBUG
   printf("> %.40s\n", str);
 #endif  // DEBUG
 
+  iov[0].iov_base = header;
+  iov[0].iov_len = snprintf(header, sizeof(header), "%zu ", textlen + len);
+  iov[1].iov_base = str;
+  iov[1].iov_len = textlen;
+  iov[2].iov_base = (void *)data;
+  iov[2].iov_len = len;
+  left = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 3;
+
   pthread_mutex_lock(&sockl);
-  char msg[10000];
-  sprintf(msg, "%zu %s", strlen(str), str);
-  ret = send(serverfd, msg, strlen(msg), 0);
-  if (ret != strlen(msg))
-    err(1, "Could not send the message");
+  while (left > 0) {
+    ret = sendmsg(serverfd, &mh, 0);
+    if (ret < 0)
+      err(1, "Could not send the message");
+    left -= ret;
+
+    // Skip what went out if the send was cut short.
+    while (mh.msg_iovlen > 0 && ret >= mh.msg_iov[0].iov_len) {
+      ret -= mh.msg_iov[0].iov_len;
+      mh.msg_iov++;
+      mh.msg_iovlen--;
+    }
+    if (mh.msg_iovlen > 0) {
+      mh.msg_iov[0].iov_base = (char *)mh.msg_iov[0].iov_base + ret;
+      mh.msg_iov[0].iov_len -= ret;
+    }
+  }
   pthread_mutex_unlock(&sockl);
   return 0;
 }
@@ -121,11 +273,37 @@ int initsocks(char *ip, int port) {
     return -3;
   }
 
+  // Offer read leases, and compression when DSM_COMPRESS is set, and wait for
+  // the manager's answer before anything else is sent. Leases need nothing
+  // more here: the manager attaches them to read grants when it uses them.
+  // The node's id tells the manager which pages it held in a checkpoint.
+  char hello[100];
+  char reply[100] = {0};
+  int headerlen;
+  snprintf(hello, sizeof(hello), "HELLO LEASE ID %d", id);
+  char *opt = getenv("DSM_COMPRESS");
+  if (opt != NULL && strcmp(opt, "0") != 0)
+    strcat(hello, " COMPRESS");
+  sendman(hello);
+  int payloadlen = peekheader(&headerlen);
+  if (headerlen + payloadlen >= sizeof(reply))
+    errx(1, "Malformed reply to HELLO");
+  recvall(reply, headerlen + payloadlen, "reply to HELLO");
+  compressing = (strstr(reply + headerlen, "COMPRESS") != NULL);
+
   return 0;
 }
 
 // Cleanup sockets.
 int teardownsocks(void) {
+  if (compressing) {
+    printf("compression: sent %ld/%ld pages compressed, ratio %.2f; "
+           "received %ld/%ld, ratio %.2f\n",
+           cstats.sentzpages, cstats.sentpages,
+           cstats.sentpages ? (double)cstats.sentbytes / (cstats.sentpages * PG_SIZE) : 1.0,
+           cstats.recvzpages, cstats.recvpages,
+           cstats.recvpages ? (double)cstats.recvbytes / (cstats.recvpages * PG_SIZE) : 1.0);
+  }
   if (pthread_mutex_destroy(&sockl) != 0) {
     return -3;
   }
@@ -146,70 +324,190 @@ int requestpage(int pgnum, char *type) {
   return sendman(msg);
 }
 
-void confirminvalidate_encoded(int pgnum, char *pgb64) {
-  char msg[10000] = {0};
-  snprintf(msg, 100 + strlen(pgb64), "INVALIDATE CONFIRMATION %d %s", pgnum, pgb64);
-  sendman(msg);
+// Ask for several pages in one message: "REQUESTPAGES WRITE 12 READ 13 ...".
+// Return 0 on success.
+int requestpages(int *pgnums, int *writes, int n) {
+  if (n == 1) {
+    return requestpage(pgnums[0], writes[0] ? "WRITE" : "READ");
+  }
+
+  char *msg = malloc(20 + n * 20);
+  if (msg == NULL)
+    return -1;
+  int len = sprintf(msg, "REQUESTPAGES");
+  int i;
+  for (i = 0; i < n; i++)
+    len += sprintf(msg + len, " %s %d", writes[i] ? "WRITE" : "READ", pgnums[i]);
+  int ret = sendman(msg);
+  free(msg);
+  return ret;
+}
+
+// Return 0 on success.
+int requestbarrier(int nodes) {
+  char msg[100] = {0};
+  snprintf(msg, 100, "BARRIER %d", nodes);
+  return sendman(msg);
+}
+
+// Return 0 on success.
+int requestcheckpoint(const char *path) {
+  char msg[PATH_MAX + 20];
+  snprintf(msg, sizeof(msg), "CHECKPOINT %s", path);
+  return sendman(msg);
+}
+
+// Wake the thread waiting in dsm_checkpoint with the manager's verdict.
+int handlecheckpoint(char *msg) {
+  pthread_mutex_lock(&checkpointm);
+  checkpointok = (strstr(msg, " OK") != NULL);
+  checkpointgen++;
+  pthread_cond_broadcast(&checkpointc);
+  pthread_mutex_unlock(&checkpointm);
+  return 0;
+}
+
+// Offer the manager read copies of the n pages in pgnums, restored from an
+// image. The answer arrives through the listener (handlewarmstart).
+// Return 0 on success.
+int requestwarmstart(int *pgnums, int n) {
+  char *msg = malloc(20 + n * 12);
+  if (msg == NULL)
+    return -1;
+  int len = sprintf(msg, "WARMSTART");
+  int i;
+  for (i = 0; i < n; i++)
+    len += sprintf(msg + len, " %d", pgnums[i]);
+  int ret = sendman(msg);
+  free(msg);
+  return ret;
+}
+
+// Handle "WARMSTART CONFIRMATION [LEASE ms] pgnum...": the pages the manager
+// accepted, in the order they were offered, are installed before the listener
+// reads on. The manager holds their locks until the reply is sent, so any
+// invalidation of them comes after it and finds them in place.
+int handlewarmstart(char *msg) {
+  char *p = msg + strlen("WARMSTART CONFIRMATION");
+  int leasems = 0;
+  if (strncmp(p, " LEASE ", strlen(" LEASE ")) == 0) {
+    p += strlen(" LEASE ");
+    leasems = strtol(p, &p, 10);
+  }
+
+  // Every page number takes at least two characters.
+  int *pgnums = malloc((strlen(p) / 2 + 1) * sizeof(int));
+  if (pgnums == NULL)
+    err(1, "Could not take the reply to WARMSTART");
+  int accepted = 0;
+  char *end;
+  while (1) {
+    long pgnum = strtol(p, &end, 10);
+    if (end == p)
+      break;
+    p = end;
+    pgnums[accepted++] = pgnum;
+  }
+  completewarmstart(pgnums, accepted, leasems);
+  free(pgnums);
+  return 0;
 }
 
-int handleconfirm(char *msg) {
+// Release the threads waiting in dsm_barrier.
+int handlebarrier(char *msg) {
+  pthread_mutex_lock(&barrierm);
+  barriergen++;
+  pthread_cond_broadcast(&barrierc);
+  pthread_mutex_unlock(&barrierm);
+  return 0;
+}
+
+// Compress page pg into zbuf unless compression is off or backing off.
+// Return the compressed length, or -1 to send the page raw.
+static int trycompress(void *pg) {
+  if (!compressing)
+    return -1;
+  if (compskip > 0) {
+    compskip--;
+    return -1;
+  }
+
+  int len = compresspage(pg, zbuf);
+  if (len < 0) {
+    if (++compfailures >= COMP_GIVEUP) {
+      compfailures = 0;
+      compskip = COMP_SKIP;
+    }
+    return -1;
+  }
+  compfailures = 0;
+  return len;
+}
+
+// Confirm an invalidation and hand back the contents of page pg, compressed
+// if that makes it smaller.
+void confirminvalidate_page(int pgnum, void *pg) {
+  char msg[100] = {0};
+  int len = trycompress(pg);
+  if (len > 0) {
+    snprintf(msg, 100, "INVALIDATE CONFIRMATION %d" PAGEZ, pgnum);
+    sendmandata(msg, zbuf, len);
+    cstats.sentzpages++;
+  } else {
+    snprintf(msg, 100, "INVALIDATE CONFIRMATION %d" PAGEDATA, pgnum);
+    sendmandata(msg, pg, PG_SIZE);
+    len = PG_SIZE;
+  }
+  cstats.sentpages++;
+  cstats.sentbytes += len;
+}
+
+// Install a granted page and wake the faults waiting for it. data is the page
+// contents that came with the grant, already in place if it was received into
+// the page's shadow, or NULL if the existing contents are current.
+int handleconfirm(char *msg, void *data) {
   char *spgnum = strstr(msg, "ION ") + 4;
   int pgnum = atoi(spgnum);
   void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)pgnum);
 
   int err;
-  int nspaces;
-
-  // Acquire mutex for condition variable.
-  pthread_mutex_lock(&waitm[pgnum % MAX_SHARED_PAGES]);
-
-  // If not using existing page, decode the b64 data into the page.  The b64
-  // string begins after the 4th ' ' character in msg.
-  if (strstr(msg, "EXISTING") == NULL) {
-    char *b64str = msg;
-    nspaces = 0;
-    while (nspaces < 4) {
-      if (b64str[0] == ' ') {
-	      nspaces++;
-      }
-      b64str++;
-    }
-    
-    char b64data[7000];
-    if (b64decode(b64str, b64data) < 0) {
-      fprintf(stderr, "Failure decoding b64 string");
-      return -1;
-    }
+  int ret = -1;
 
+  pthread_mutex_lock(&faultm);
+
+  // Without a shadow the data sits in the staging page; copy it in once.
+  if (data != NULL && data != shadowpage(pg)) {
     // memcpy -- must set to write first to fill in page!
     if ((err = mprotect(pg, 1, (PROT_READ|PROT_WRITE))) != 0) {
       fprintf(stderr, "permission setting of page addr %p failed with error %d\n", pg, err);
-      return -1;
-    }
-    if (memcpy(pg, b64data, PG_SIZE) == NULL) {
-      fprintf(stderr, "memcpy failed.\n");
-      return -1;
+      goto out;
     }
+    memcpy(pg, data, PG_SIZE);
   }
 
   if (strstr(msg, "WRITE") == NULL) {
     if ((err = mprotect(pg, 1, PROT_READ)) != 0) {
       fprintf(stderr, "permission setting of page addr %p failed with error %d\n", pg, err);
-      return -1;
+      goto out;
+    }
+    char *lease = strstr(msg, " LEASE ");
+    if (lease != NULL) {
+      grantlease(pgnum, atoi(lease + strlen(" LEASE ")), requestsent(pgnum));
     }
   } else {
+    cancellease(pgnum);
     if ((err = mprotect(pg, 1, PROT_READ|PROT_WRITE)) != 0) {
       fprintf(stderr, "permission setting of page addr %p failed with error %d\n", pg, err);
-      return -1;
+      goto out;
     }
   }
+  ret = 0;
 
-  // Signal to the page handler that they can now run.
-  pthread_cond_signal(&waitc[pgnum % MAX_SHARED_PAGES]);
-
-  // Unlock to allow another page fault to be handled.
-  pthread_mutex_unlock(&waitm[pgnum % MAX_SHARED_PAGES]); 
-  return 0;
+out:
+  // Wake the faulting threads even on failure; they fault again.
+  completefault(pgnum);
+  pthread_mutex_unlock(&faultm);
+  return ret;
 }
 
 // Handle invalidate messages.
@@ -219,8 +517,7 @@ int invalidate(char *msg) {
   int pgnum = atoi(spgnum);
   void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)pgnum);
 
-  // If we don't need to reply with a b64-encoding of the page, just invalidate
-  // and reply.
+  // If we don't need to reply with the page, just invalidate and reply.
   if (strstr(msg, "PAGEDATA") == NULL) {
     if ((err = mprotect(pg, 1, PROT_NONE)) != 0) {
       fprintf(stderr, "Invalidation of page addr %p failed with error %d\n", pg, err);
@@ -230,22 +527,85 @@ int invalidate(char *msg) {
     return 0;
   }
 
-  // We need to reply with a b64-encoding of the page. Set to read-only, encode
-  // the page, set to non-readable, non-writeable, and confirm with the
-  // encoding.
-  // TODO: We need to hold a lock to prevent the page from becoming
-  // writeable while we are encoding it. (Do we?)
-  if (mprotect(pg, 1, PROT_READ) != 0) {
-    fprintf(stderr, "Invalidation of page addr %p failed\n", pg);
-    return -1;
+  // We need to reply with the page. Revoke access first so no write can slip
+  // in after the data is taken, then send the page from its shadow. Without a
+  // shadow, copy it out to the staging page while it is still readable.
+  void *data = shadowpage(pg);
+  if (data == NULL) {
+    if (mprotect(pg, 1, PROT_READ) != 0) {
+      fprintf(stderr, "Invalidation of page addr %p failed\n", pg);
+      return -1;
+    }
+    memcpy(staging, pg, PG_SIZE);
+    data = staging;
   }
-  char pgb64[PG_SIZE * 2] = {0};
-  b64encode((const char *)pg, PG_SIZE, pgb64);
   if (mprotect(pg, 1, PROT_NONE) != 0) {
     fprintf(stderr, "Invalidation of page addr %p failed\n", pg);
     return -1;
   }
-  confirminvalidate_encoded(pgnum, pgb64);
+  confirminvalidate_page(pgnum, data);
+  return 0;
+}
+
+
+// Revoke access to npages pages starting at page number pgnum.
+static int protectrun(long pgnum, long npages) {
+  void *pg = (void *)PGNUM_TO_PGADDR((uintptr_t)pgnum);
+  if (mprotect(pg, npages * PG_SIZE, PROT_NONE) != 0) {
+    fprintf(stderr, "Invalidation of %ld pages at %p failed\n", npages, pg);
+    return -1;
+  }
   return 0;
 }
 
+// Handle batched invalidations of read copies: "INVALIDATEBATCH pg pg ...",
+// with page numbers in ascending order. Runs of consecutive pages are revoked
+// with one mprotect, and every page is confirmed in a single reply, or in
+// several if they do not fit in one.
+int invalidatebatch(char *msg) {
+  char reply[10000];
+  int len = snprintf(reply, sizeof(reply), "INVALIDATEBATCH CONFIRMATION");
+  char *p = msg + strlen("INVALIDATEBATCH");
+  char *end;
+  long runstart = 0;
+  long runlen = 0;
+  int ret = 0;
+
+  while (1) {
+    long pgnum = strtol(p, &end, 10);
+    if (end == p) {
+      break;
+    }
+    p = end;
+
+    if (runlen > 0 && pgnum == runstart + runlen) {
+      runlen++;
+    } else {
+      if (runlen > 0 && protectrun(runstart, runlen) < 0) {
+        ret = -1;
+      }
+      runstart = pgnum;
+      runlen = 1;
+    }
+    int n = snprintf(reply + len, sizeof(reply) - len, " %ld", pgnum);
+    if (n >= (int)sizeof(reply) - len) {
+      // The reply is full: confirm the pages in it, once dropped, and go on
+      // in another one.
+      if (protectrun(runstart, runlen) < 0) {
+        ret = -1;
+      }
+      runlen = 0;
+      reply[len] = '\0';
+      sendman(reply);
+      len = snprintf(reply, sizeof(reply), "INVALIDATEBATCH CONFIRMATION");
+      n = snprintf(reply + len, sizeof(reply) - len, " %ld", pgnum);
+    }
+    len += n;
+  }
+  if (runlen > 0 && protectrun(runstart, runlen) < 0) {
+    ret = -1;
+  }
+
+  sendman(reply);
+  return ret;
+}
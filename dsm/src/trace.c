@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_HALF 4096
+
+// Trace state. Records go into a buffer of two halves, and each half is
+// written out with write(2) once it is full. No lock is taken: a recorder
+// claims a slot with an atomic increment of tracenext and counts its record
+// in tracefilled once it is written, and the recorder that fills a half
+// writes it out.
+//
+// Faults are not recorded in the SIGSEGV handler, which only posts them to the
+// faultservice thread; they are recorded once complete, in completefault, by
+// the listener thread that installed the page. Taking no lock, a recorder
+// only ever waits for another one writing out a full half.
+static int tracefd = -1;
+static uint16_t tracenode;
+static struct tracerec tracebuf[2 * TRACE_HALF];
+static uint64_t tracenext;     // Slots claimed so far.
+static uint64_t traceflushed;  // Halves written out so far.
+static int tracefilled[2];     // Records written into each half.
+
+// Write n records to fd. Return 0 on success.
+static int writerecs(int fd, struct tracerec *recs, size_t n) {
+  size_t len = n * sizeof(struct tracerec);
+  char *p = (char *)recs;
+  while (len > 0) {
+    ssize_t ret = write(fd, p, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+// Wait until fewer than n halves are behind the writer. Spins rather than
+// blocking, so that it is safe where a signal handler may call it.
+static void awaitflushed(uint64_t n) {
+  while (__atomic_load_n(&traceflushed, __ATOMIC_ACQUIRE) < n) {
+    sched_yield();
+  }
+}
+
+// Start recording faults to the file at path.
+// Return 0 on success.
+int inittrace(const char *path, int node) {
+  struct traceheader hdr;
+
+  int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open trace file %s.\n", path);
+    return -1;
+  }
+
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = TRACE_VERSION;
+  hdr.recsize = sizeof(struct tracerec);
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    fprintf(stderr, "Could not write trace header.\n");
+    close(fd);
+    return -1;
+  }
+
+  tracenode = node;
+  tracenext = 0;
+  traceflushed = 0;
+  tracefilled[0] = tracefilled[1] = 0;
+  __atomic_store_n(&tracefd, fd, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void tracefault(uintptr_t pgnum, int access, uint64_t start_us,
+                uint64_t end_us) {
+  int fd = __atomic_load_n(&tracefd, __ATOMIC_ACQUIRE);
+  if (fd < 0) {
+    return;
+  }
+
+  uint64_t slot = __atomic_fetch_add(&tracenext, 1, __ATOMIC_RELAXED);
+  uint64_t gen = slot / TRACE_HALF;
+  int half = gen % 2;
+  // The half may still hold records of two halves ago being written out.
+  if (gen >= 2) {
+    awaitflushed(gen - 1);
+  }
+
+  struct tracerec *r = &tracebuf[slot % (2 * TRACE_HALF)];
+  r->ts_us = start_us;
+  r->pgnum = pgnum;
+  r->latency_us = end_us - start_us;
+  r->node = tracenode;
+  r->access = access;
+  r->source = TRACE_SRC_NODE;
+  if (__atomic_add_fetch(&tracefilled[half], 1, __ATOMIC_ACQ_REL) < TRACE_HALF) {
+    return;
+  }
+
+  // Halves go out in order, so the previous one must be written first.
+  awaitflushed(gen);
+  __atomic_store_n(&tracefilled[half], 0, __ATOMIC_RELAXED);
+  if (writerecs(fd, &tracebuf[half * TRACE_HALF], TRACE_HALF) < 0 &&
+      __atomic_exchange_n(&tracefd, -1, __ATOMIC_ACQ_REL) == fd) {
+    static const char msg[] = "Could not write trace, tracing stopped.\n";
+    ssize_t ignored = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)ignored;
+    close(fd);
+  }
+  __atomic_store_n(&traceflushed, gen + 1, __ATOMIC_RELEASE);
+}
+
+// Call once no more faults are being recorded.
+int teardowntrace(void) {
+  int fd = __atomic_exchange_n(&tracefd, -1, __ATOMIC_ACQ_REL);
+  if (fd < 0) {
+    return 0;
+  }
+
+  // Write out the records of the half being filled, once they are all in.
+  uint64_t claimed = __atomic_load_n(&tracenext, __ATOMIC_ACQUIRE);
+  uint64_t gen = claimed / TRACE_HALF;
+  int half = gen % 2;
+  int left = claimed % TRACE_HALF;
+  awaitflushed(gen);
+  while (__atomic_load_n(&tracefilled[half], __ATOMIC_ACQUIRE) < left) {
+    sched_yield();
+  }
+  int ret = writerecs(fd, &tracebuf[half * TRACE_HALF], left);
+  close(fd);
+  return ret;
+}
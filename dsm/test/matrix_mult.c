@@ -1,14 +1,34 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
 #define SIZE 2000
 
+// Serial reference multiply of n x n row-major matrices: c += a * b.
+// matrixmultiply3 links this in (built with -DMATRIX_MULT_NO_MAIN) to check
+// its distributed result.
+void matrix_mult(int n, const int *a, const int *b, int *c) {
+  int i, j, k;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < n; j++) {
+      for (k = 0; k < n; k++) {
+        c[i * n + j] += a[i * n + k] * b[k * n + j];
+      }
+    }
+  }
+}
+
+#ifndef MATRIX_MULT_NO_MAIN
+
 int A[SIZE][SIZE] = {{0}};
 int B[SIZE][SIZE] = {{0}};
 int C[SIZE][SIZE] = {{0}};
 
+void print_matrix(int matrix[SIZE][SIZE]);
+int randint();
+
 int main() {
-  int i, j, k;
+  int i, j;
   srand(time(NULL));
 
   for (i = 0; i < SIZE; i++) {
@@ -18,13 +38,7 @@ int main() {
     }
   }
 
-  for (i = 0; i < SIZE; i++) {
-    for (j = 0; j < SIZE; j++) {
-      for (k = 0; k < SIZE; k++) {
-        C[i][j] += A[i][k] * B[k][j];
-      }
-    }
-  }
+  matrix_mult(SIZE, &A[0][0], &B[0][0], &C[0][0]);
 
   //printf("Matrix A\n--------\n");
   //print_matrix(A);
@@ -49,3 +63,5 @@ void print_matrix(int matrix[SIZE][SIZE]) {
 int randint() {
   return rand() % 10;
 }
+
+#endif  // MATRIX_MULT_NO_MAIN
@@ -0,0 +1,109 @@
+#!/usr/bin/perl
+# Runs every workload of bench_main.c against the sys, hw7 and par backends
+# and prints a Markdown table of operations per second and peak RSS.
+#
+#   perl bench.pl [--seconds S] [--threads 1,2,4] [--readme README.md]
+#
+# Thread counts default to the powers of two below the number of cores and
+# the number of cores itself. prodcons runs producer and consumer pairs, so
+# its counts are rounded down to even ones, and at least 2; the table shows
+# the thread count each run reports. With --readme, the table replaces the
+# one between the bench markers of that file. A run that fails, reports
+# errors or times out shows as "fail".
+use 5.16.0;
+use warnings FATAL => 'all';
+use Getopt::Long;
+
+my @BACKENDS = qw(sys hw7 par);
+my @WORKLOADS = qw(larson prodcons random realloc);
+my $BEGIN = "<!-- bench table start -->";
+my $END = "<!-- bench table end -->";
+
+my $seconds = 1;
+my $threads;
+my $readme;
+GetOptions("seconds=f" => \$seconds,
+           "threads=s" => \$threads,
+           "readme=s" => \$readme) or die "bad options\n";
+
+my @threads;
+if (defined $threads) {
+    @threads = split /,/, $threads;
+} else {
+    chomp(my $cores = `nproc` || 1);
+    for (my $n = 1; $n < $cores; $n *= 2) {
+        push @threads, $n;
+    }
+    push @threads, $cores;
+}
+
+sub run_bench {
+    my ($backend, $workload, $nthreads) = @_;
+    my $limit = int($seconds * 10) + 30;
+    my $out = `timeout $limit ./bench-$backend $workload $nthreads $seconds 2>&1`;
+    if ($? != 0 || $out !~ /threads (\d+): (\d+) ops\/s, peak RSS (\d+) KB, errors 0$/m) {
+        return;
+    }
+    return ($2, $3, $1);
+}
+
+sub human {
+    my ($ops) = @_;
+    return sprintf("%.1fM", $ops / 1e6) if $ops >= 1e6;
+    return sprintf("%.0fK", $ops / 1e3) if $ops >= 1e3;
+    return sprintf("%.0f", $ops);
+}
+
+my @header = ("Workload", "Threads",
+              (map { "$_ ops/s" } @BACKENDS),
+              (map { "$_ RSS MB" } @BACKENDS));
+my @rows;
+for my $workload (@WORKLOADS) {
+    my @counts = @threads;
+    if ($workload eq "prodcons") {
+        my %seen;
+        @counts = grep { !$seen{$_}++ } map { $_ < 2 ? 2 : $_ - $_ % 2 } @threads;
+    }
+    for my $nthreads (@counts) {
+        my (@ops, @rss);
+        my $ran = $nthreads;
+        for my $backend (@BACKENDS) {
+            my ($o, $r, $t) = run_bench($backend, $workload, $nthreads);
+            push @ops, defined $o ? human($o) : "fail";
+            push @rss, defined $r ? sprintf("%.1f", $r / 1024) : "fail";
+            $ran = $t if defined $t;
+        }
+        push @rows, [$workload, $ran, @ops, @rss];
+        say STDERR "# $workload $ran: @ops";
+    }
+}
+
+my @widths = map { length } @header;
+for my $row (@rows) {
+    for my $i (0 .. $#$row) {
+        $widths[$i] = length($row->[$i]) if length($row->[$i]) > $widths[$i];
+    }
+}
+
+sub line {
+    my @cells = @_;
+    return "| " . join(" | ", map { sprintf("%*s", $widths[$_], $cells[$_]) } 0 .. $#cells) . " |\n";
+}
+
+my $table = line(@header);
+$table .= "| " . join(" | ", map { "-" x $_ } @widths) . " |\n";
+$table .= line(@$_) for @rows;
+
+if (!defined $readme) {
+    print $table;
+    exit 0;
+}
+
+open(my $in, "<", $readme) or die "$readme: $!\n";
+my $text = do { local $/; <$in> };
+close($in);
+$text =~ s/\Q$BEGIN\E\n.*?\Q$END\E/$BEGIN\n$table$END/s
+    or die "no bench markers in $readme\n";
+open(my $out, ">", $readme) or die "$readme: $!\n";
+print $out $text;
+close($out);
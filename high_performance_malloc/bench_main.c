@@ -0,0 +1,339 @@
+
+// Allocator benchmarks, linked against each backend like the Collatz drivers:
+//
+//   bench-par WORKLOAD THREADS [SECONDS]
+//
+// runs one workload on THREADS threads for SECONDS (1 by default), then
+// prints the calls to xmalloc, xrealloc and xfree made per second and the
+// peak RSS of the process. The workloads:
+//
+//  - larson:   server churn, after Larson and Krishnan. Each thread keeps
+//              SLOTS blocks of 16 to 1024 bytes and replaces random ones.
+//              Every ROUND operations it hands its blocks to a new thread,
+//              which frees what the old one allocated.
+//  - prodcons: producers allocate 16 to 256 byte messages and pass them
+//              through a queue to consumers, which free them; THREADS / 2
+//              pairs, at least one.
+//  - random:   random replacement among SLOTS blocks of 8 bytes to 1MB,
+//              spread evenly over the powers of two.
+//  - realloc:  buffers grown by appends of 16 to 128 bytes with xrealloc,
+//              up to GROW_MAX bytes, then freed.
+//
+// Blocks are tagged at both ends, and the tags checked when they are freed,
+// so a backend that hands out overlapping memory shows up as errors. Realloc
+// buffers are also checked after every xrealloc, for the head tag and the
+// tail tag of the old size. Only
+// the tags are written, so the RSS counts pages the allocator itself touched
+// plus one or two per block.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+
+#define MAX_THREADS 256
+#define SLOTS 1000
+#define ROUND 10000
+#define QUEUE 1024
+#define GROW_MAX (256 << 10)
+// the first byte of every realloc buffer, never rewritten
+#define REALLOC_HEAD ((char) 0x5a)
+
+typedef struct slot {
+    char*  ptr;
+    size_t size;
+} slot;
+
+// A single-producer single-consumer ring of messages.
+typedef struct queue {
+    char* items[QUEUE];
+    long  head;
+    long  tail;
+    int   done;
+} queue;
+
+typedef struct task {
+    unsigned long rng;
+    long   ops;
+    queue* q;
+    slot   slots[SLOTS];
+} task;
+
+static int  stop = 0;
+static long errors = 0;
+
+static int
+stopped()
+{
+    return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+// xorshift64
+static unsigned long
+next_rand(unsigned long* state)
+{
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static char
+tag(size_t size)
+{
+    return (char) (size * 131 + 7);
+}
+
+static char*
+alloc_tagged(size_t size)
+{
+    char* ptr = xmalloc(size);
+    ptr[0] = tag(size);
+    ptr[size - 1] = tag(size);
+    return ptr;
+}
+
+static void
+free_tagged(char* ptr, size_t size)
+{
+    if (ptr[0] != tag(size) || ptr[size - 1] != tag(size)) {
+        __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    }
+    xfree(ptr);
+}
+
+static void
+replace(task* tt, slot* ss, size_t size)
+{
+    if (ss->ptr) {
+        free_tagged(ss->ptr, ss->size);
+        tt->ops += 1;
+    }
+    ss->ptr = alloc_tagged(size);
+    ss->size = size;
+    tt->ops += 1;
+}
+
+static void
+free_slots(task* tt)
+{
+    for (int ii = 0; ii < SLOTS; ++ii) {
+        if (tt->slots[ii].ptr) {
+            free_tagged(tt->slots[ii].ptr, tt->slots[ii].size);
+            tt->slots[ii].ptr = 0;
+            tt->ops += 1;
+        }
+    }
+}
+
+void*
+larson_round(void* arg)
+{
+    task* tt = arg;
+    for (int ii = 0; ii < ROUND && !stopped(); ++ii) {
+        slot* ss = &tt->slots[next_rand(&tt->rng) % SLOTS];
+        replace(tt, ss, 16 + next_rand(&tt->rng) % 1009);
+    }
+    return 0;
+}
+
+void*
+larson_worker(void* arg)
+{
+    task* tt = arg;
+    while (!stopped()) {
+        pthread_t thread;
+        int rv = pthread_create(&thread, 0, larson_round, tt);
+        assert(rv == 0);
+        rv = pthread_join(thread, 0);
+        assert(rv == 0);
+    }
+    free_slots(tt);
+    return 0;
+}
+
+void*
+producer_worker(void* arg)
+{
+    task* tt = arg;
+    queue* qq = tt->q;
+    while (!stopped()) {
+        long head = __atomic_load_n(&qq->head, __ATOMIC_ACQUIRE);
+        if (qq->tail - head == QUEUE) {
+            sched_yield();
+            continue;
+        }
+        size_t size = 16 + next_rand(&tt->rng) % 241;
+        char* msg = alloc_tagged(size);
+        memcpy(msg + 1, &size, sizeof(size));
+        qq->items[qq->tail % QUEUE] = msg;
+        __atomic_store_n(&qq->tail, qq->tail + 1, __ATOMIC_RELEASE);
+        tt->ops += 1;
+    }
+    __atomic_store_n(&qq->done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void*
+consumer_worker(void* arg)
+{
+    task* tt = arg;
+    queue* qq = tt->q;
+    for (;;) {
+        int done = __atomic_load_n(&qq->done, __ATOMIC_ACQUIRE);
+        long tail = __atomic_load_n(&qq->tail, __ATOMIC_ACQUIRE);
+        if (qq->head == tail) {
+            if (done) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        char* msg = qq->items[qq->head % QUEUE];
+        size_t size;
+        memcpy(&size, msg + 1, sizeof(size));
+        free_tagged(msg, size);
+        __atomic_store_n(&qq->head, qq->head + 1, __ATOMIC_RELEASE);
+        tt->ops += 1;
+    }
+    return 0;
+}
+
+void*
+random_worker(void* arg)
+{
+    task* tt = arg;
+    while (!stopped()) {
+        slot* ss = &tt->slots[next_rand(&tt->rng) % 64];
+        int shift = 3 + next_rand(&tt->rng) % 17;
+        size_t size = (1ul << shift) + next_rand(&tt->rng) % (1ul << shift);
+        replace(tt, ss, size > (1 << 20) ? (1 << 20) : size);
+    }
+    free_slots(tt);
+    return 0;
+}
+
+void*
+realloc_worker(void* arg)
+{
+    task* tt = arg;
+    while (!stopped()) {
+        size_t size = 16;
+        char* buf = xmalloc(size);
+        buf[0] = REALLOC_HEAD;
+        buf[size - 1] = tag(size);
+        tt->ops += 1;
+        while (size < GROW_MAX && !stopped()) {
+            size_t old = size;
+            size += 16 + next_rand(&tt->rng) % 113;
+            buf = xrealloc(buf, size);
+            // the head and the old tail must have moved with the buffer
+            if (buf[0] != REALLOC_HEAD || buf[old - 1] != tag(old)) {
+                __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+            }
+            buf[size - 1] = tag(size);
+            tt->ops += 1;
+        }
+        if (buf[0] != REALLOC_HEAD || buf[size - 1] != tag(size)) {
+            __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+        }
+        xfree(buf);
+        tt->ops += 1;
+    }
+    return 0;
+}
+
+static double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char* argv[])
+{
+    static const struct {
+        const char* name;
+        void* (*worker)(void*);
+    } workloads[] = {
+        { "larson", larson_worker },
+        { "prodcons", producer_worker },
+        { "random", random_worker },
+        { "realloc", realloc_worker },
+    };
+
+    if (argc < 3) {
+        printf("Usage:\n");
+        printf("\t%s larson|prodcons|random|realloc THREADS [SECONDS]\n", argv[0]);
+        return 1;
+    }
+
+    int kind = -1;
+    for (int ii = 0; ii < (int) (sizeof(workloads) / sizeof(workloads[0])); ++ii) {
+        if (strcmp(argv[1], workloads[ii].name) == 0) {
+            kind = ii;
+        }
+    }
+    int nthreads = atoi(argv[2]);
+    double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+    if (kind < 0 || nthreads < 1 || nthreads > MAX_THREADS) {
+        fprintf(stderr, "bad workload or thread count\n");
+        return 1;
+    }
+
+    // prodcons runs pairs, with the consumer after its producer
+    int prodcons = workloads[kind].worker == producer_worker;
+    if (prodcons) {
+        nthreads = nthreads < 2 ? 2 : nthreads / 2 * 2;
+    }
+
+    // the benchmark's own bookkeeping comes from the system allocator
+    task* tasks = calloc(nthreads, sizeof(task));
+    pthread_t threads[MAX_THREADS];
+    double start = now();
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        tasks[ii].rng = 0x9e3779b97f4a7c15ul * (ii + 1);
+        void* (*worker)(void*) = workloads[kind].worker;
+        if (prodcons && ii % 2 == 0) {
+            tasks[ii].q = calloc(1, sizeof(queue));
+        }
+        else if (prodcons) {
+            tasks[ii].q = tasks[ii - 1].q;
+            worker = consumer_worker;
+        }
+        int rv = pthread_create(&(threads[ii]), 0, worker, &tasks[ii]);
+        assert(rv == 0);
+    }
+
+    struct timespec nap = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    nanosleep(&nap, 0);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    long ops = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+        ops += tasks[ii].ops;
+    }
+    double elapsed = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%s threads %d: %.0f ops/s, peak RSS %ld KB, errors %ld\n",
+           workloads[kind].name, nthreads, ops / elapsed, usage.ru_maxrss, errors);
+
+    return errors != 0;
+}
@@ -0,0 +1,131 @@
+#!/usr/bin/perl
+# Generates size_classes.h: the small-object size classes of opt_malloc and
+# a table mapping every 16-byte granule of a request size to its class.
+#
+# Classes are multiples of 16 bytes. Each class is the largest one that keeps
+# the waste of a request just above the previous class at or below 12.5%,
+# which is only impossible for the first few classes, where a 16-byte step is
+# already more than that.
+#
+# Each class also gets the number of blocks moved at once between a thread's
+# cache and the central transfer cache, and how many blocks a thread may keep:
+# about BATCH_BYTES and CACHE_BYTES worth, within fixed bounds. A thread's
+# caches are arrays laid out one after another, class_cache_off apart.
+#
+#   perl gen_size_classes.pl > size_classes.h
+use 5.16.0;
+use warnings FATAL => 'all';
+
+my $GRANULE = 16;
+my $MAX_SMALL = 4096;
+my $MAX_WASTE = 0.125;
+my $BATCH_BYTES = 8192;
+my $MIN_BATCH = 2;
+my $MAX_BATCH = 32;
+my $CACHE_BYTES = 32768;
+
+my @classes = ($GRANULE);
+while ($classes[-1] < $MAX_SMALL) {
+    my $prev = $classes[-1];
+    my $next = $prev + $GRANULE;
+    # Grow while a request of prev + 1 bytes would waste at most MAX_WASTE.
+    while ($next + $GRANULE <= $MAX_SMALL &&
+           ($next + $GRANULE - ($prev + 1)) / ($next + $GRANULE) <= $MAX_WASTE) {
+        $next += $GRANULE;
+    }
+    push @classes, $next;
+}
+
+my @lookup;
+my $cls = 0;
+for my $granule (0 .. $MAX_SMALL / $GRANULE) {
+    my $bytes = $granule * $GRANULE;
+    $cls++ while $classes[$cls] < $bytes;
+    push @lookup, $cls;
+}
+
+sub clamp {
+    my ($x, $lo, $hi) = @_;
+    return $x < $lo ? $lo : $x > $hi ? $hi : $x;
+}
+
+my @batch = map { clamp(int($BATCH_BYTES / $_), $MIN_BATCH, $MAX_BATCH) } @classes;
+my @cache_max;
+for my $i (0 .. $#classes) {
+    my $cap = int($CACHE_BYTES / $classes[$i]);
+    push @cache_max, $cap > 2 * $batch[$i] ? $cap : 2 * $batch[$i];
+}
+my @cache_off;
+my $cache_slots = 0;
+for my $cap (@cache_max) {
+    push @cache_off, $cache_slots;
+    $cache_slots += $cap;
+}
+
+sub rows {
+    my ($per_row, @items) = @_;
+    my @rows;
+    while (my @row = splice(@items, 0, $per_row)) {
+        push @rows, "\t" . join(", ", @row) . ",";
+    }
+    return join("\n", @rows);
+}
+
+my $nclasses = scalar @classes;
+my $ngranules = scalar @lookup;
+my $class_rows = rows(8, @classes);
+my $lookup_rows = rows(16, @lookup);
+my $batch_rows = rows(16, @batch);
+my $cache_rows = rows(16, @cache_max);
+my $off_rows = rows(16, @cache_off);
+
+print <<"END";
+/* Generated by gen_size_classes.pl; do not edit. */
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+
+#include <stddef.h>
+
+#define NUM_CLASSES $nclasses
+#define CLASS_GRANULE $GRANULE
+#define MAX_SMALL_SIZE $MAX_SMALL
+#define MAX_BATCH $MAX_BATCH
+#define CACHE_SLOTS $cache_slots
+
+/* Bytes handed out for each class. */
+static const unsigned short class_size[NUM_CLASSES] = {
+$class_rows
+};
+
+/* Blocks moved at once between a thread cache and the transfer cache. */
+static const unsigned char class_batch[NUM_CLASSES] = {
+$batch_rows
+};
+
+/* Most blocks of each class a thread cache holds. */
+static const unsigned short class_cache_max[NUM_CLASSES] = {
+$cache_rows
+};
+
+/* Where each class's array starts among a thread's CACHE_SLOTS. */
+static const unsigned short class_cache_off[NUM_CLASSES] = {
+$off_rows
+};
+
+/* Class of a request, indexed by its size in granules, rounded up. */
+static const unsigned char class_of_granule[$ngranules] = {
+$lookup_rows
+};
+
+/**
+ * Finds the size class of a small request in constant time
+ * \@param bytes request size, at most MAX_SMALL_SIZE
+ * \@return index into class_size
+ */
+static inline int size_class(size_t bytes)
+{
+	return class_of_granule[(bytes + CLASS_GRANULE - 1) / CLASS_GRANULE];
+}
+
+#endif
+END
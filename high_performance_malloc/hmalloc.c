@@ -182,7 +182,7 @@ void *hmalloc_small(size_t size)
 
 void *hmalloc_big(size_t size)
 {
-	int total_pages = div_up(size, PAGE_SIZE);
+	int total_pages = div_up(size + sizeof(header), PAGE_SIZE);
 	header *result = map_pages(total_pages);
 	result->size = total_pages * PAGE_SIZE;
 	return result + 1;
@@ -206,6 +206,12 @@ void *hmalloc(size_t size)
 	return ret_val;
 }
 
+size_t husable_size(void *item)
+{
+	header *hdr = (header *) (item - sizeof(header));
+	return hdr->size - sizeof(header);
+}
+
 void hfree_big(header *hdr)
 {
 	long pages_unmapped = div_up(hdr->size, PAGE_SIZE);
@@ -14,5 +14,6 @@ void hprintstats();
 
 void* hmalloc(size_t size);
 void hfree(void* item);
+size_t husable_size(void* item);
 
 #endif
@@ -1,312 +1,1827 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
 
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+
 #include "opt_malloc.h"
+#include "opt_prof.h"
+#include "size_classes.h"
 
 #define PAGE_SIZE 4096
-#define BIG_SIZE (PAGE_SIZE * 1000)
-#define SEGREGATED_LIST_ALLOC_SIZE 1000
-#define BIN_ALLOC_SIZE 600
-#define NUM_BINS 7
+#define SLAB_SIZE (64 << 10)
+#define CHUNK_SIZE (4 << 20)
+#define LARGE_CLASS (-1)
+/* a large span holding one sampled block of any size, see opt_prof.c */
+#define SAMPLED_CLASS (-2)
+/* freed large spans up to this many pages are kept for reuse */
+#define LARGE_CACHE_PAGES 256
+#define LARGE_CACHE_BYTES (32 << 20)
+/* large span lengths: pages up to 4, then 4 per doubling up to the above */
+#define LARGE_BUCKETS 29
+/* how many buckets past its own a span may be taken from */
+#define LARGE_CACHE_FIT 8
+/* batches of each class the transfer cache holds */
+#define TRANSFER_BATCHES 64
+
+typedef struct arena_t arena;
 
-typedef struct arena_t {
-	node *free_list;
-	node *free_list_16;
-	node *free_list_24;
-	node *free_list_64;
-	node *bins[NUM_BINS];
+/*
+ * Every block lives in a SLAB_SIZE-aligned slab that starts with this header,
+ * so the block's class and owner are found by masking its address. A small
+ * slab holds blocks of one size class. Blocks are carved off at the bump
+ * pointer as they are first needed, and once freed go on the slab's own list
+ * of free blocks, so a new slab costs nothing but its header. A large
+ * allocation gets a slab-aligned mapping of its own, with class
+ * LARGE_CLASS and the mapping's length in size, and used set once mremap has
+ * grown it. So does a block the heap profiler samples, with class
+ * SAMPLED_CLASS and its record after the header. A block aligned to more than
+ * SLAB_SIZE / 2 starts right after its span's first slab.
+ */
+typedef struct slab_t {
+	arena *owner;
+	size_t size;
+	int cls;
+	unsigned short used;
+	unsigned short released;
+	node *free;
+	char *bump;
+	/* neighbours in the bin of slabs with free blocks, or in the empty list */
+	struct slab_t *next;
+	struct slab_t *prev;
+	/* when the slab became empty, in milliseconds */
+	uint64_t empty_since;
+} __attribute__((aligned(64))) slab;
 
-} arena;
+struct arena_t {
+	/* blocks in each class's array of the thread cache */
+	unsigned short cache_count[NUM_CLASSES];
+	/* counters of this arena's thread, summed over arenas by opt_getstats */
+	unsigned long nmalloc[NUM_CLASSES];
+	unsigned long nfree[NUM_CLASSES];
+	unsigned long large_nmalloc;
+	unsigned long large_nfree;
+	/* bytes of large spans this thread took and gave back */
+	size_t large_taken;
+	size_t large_given;
+	/* slabs with free blocks, one list per size class */
+	slab *bins[NUM_CLASSES];
+	/* blocks freed by other threads, pushed lock-free and drained by the owner */
+	node *remote_free;
+	/* unused part of the chunk slabs are cut from */
+	char *chunk_next;
+	char *chunk_end;
+	/* slabs with no blocks in use, shared with the scavenger */
+	pthread_mutex_t empty_lock;
+	slab *empty;
+	arena *next_arena;
+	/* next arena in the pool of arenas whose threads have exited */
+	arena *next_pooled;
+#ifdef OPT_MALLOC_HIST
+	/* this thread's allocation latencies, and how many times it refilled */
+	struct hist_t *hist;
+	unsigned long refills;
+#endif
+	/*
+	 * The thread cache: for each class an array (a magazine) of up to
+	 * class_cache_max free blocks, starting at class_cache_off. Blocks are
+	 * popped and pushed at the top, so taking one never reads the block.
+	 */
+	void *cache[CACHE_SLOTS];
+};
 
-static __thread arena aren;
+/* all arenas, for the scavenger, and the pooled ones waiting for a thread */
+static arena *arenas;
+static arena *arena_pool;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
 
-/**
- * bins[0] -> 32 bytes
- * bins[1] -> 128 bytes (64 bytes handled by segregation)
- * bins[2] -> 256 bytes
- * bins[3] -> 512 bytes
- * bins[4] -> 1024 bytes
- * bins[5] -> 2048 bytes
- * bins[6] -> 4096 bytes
- **/
-static size_t sizes[NUM_BINS] = {32, 128, 256, 512, 1024, 2048, 4096};
+/*
+ * Byte counts kept on the slow paths: everything mapped, the slabs cut from
+ * chunks, the slab pages handed back with madvise, and the large spans
+ * (in use or cached).
+ */
+static size_t stat_mapped;
+static size_t stat_slabs;
+static size_t stat_released;
+static size_t stat_large;
+
+static inline void stat_add(size_t *counter, long delta)
+{
+	__atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+}
+
+/* how long empty slabs stay resident, or -1 to release them at once */
+static long decay_ms = -1;
+static int initialized;
+
+/*
+ * The transfer cache between the thread caches of all arenas: up to
+ * TRANSFER_BATCHES batches of class_batch free blocks of one class, stored as
+ * an array of pointers. A thread cache that overflows hands a batch over and
+ * one that runs empty takes a batch, so blocks a thread frees reach threads
+ * that allocate without going back to the slabs, and without a lock on every
+ * call. Batches are copied, and the blocks themselves are not touched.
+ */
+typedef struct transfer_t {
+	pthread_mutex_t lock;
+	int count;
+	void *blocks[TRANSFER_BATCHES * MAX_BATCH];
+} transfer;
+
+static transfer transfers[NUM_CLASSES] = {
+	[0 ... NUM_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+/*
+ * Per-CPU caches, used instead of the thread caches when OPT_MALLOC_PERCPU is
+ * set. Each CPU has a block of pcpu_block bytes: a lock word for when rseq is
+ * not available, then for each class at pcpu_off a count and an array of
+ * class_cache_max free blocks. Cached memory is then bounded by the number of
+ * CPUs rather than of threads.
+ */
+static int percpu;
+static int ncpus;
+static char *pcpu_base;
+static size_t pcpu_block;
+static size_t pcpu_off[NUM_CLASSES];
+#ifdef HAVE_RSEQ
+/* this thread's rseq area is registered, so its cpu_id can be trusted */
+static __thread int use_rseq;
+#endif
+
+/* freed large spans, one list per bucket, shared by all threads */
+static slab *large_cache[LARGE_BUCKETS];
+static size_t large_cached;
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Arenas are mapped rather than thread local, so that a thread freeing a block
+ * of an arena whose thread has exited still has somewhere to push it. When a
+ * thread exits its arena goes to a pool, and the next new thread adopts it
+ * together with its slabs and free blocks.
+ */
+static __thread arena *aren;
+
+/*
+ * Once its arena is pooled, a thread is exiting, and the allocations of the
+ * thread-exit destructors that run after pool_arena use one arena shared by
+ * all exiting threads, under teardown_lock. Adopting an arena again would
+ * need pool_arena to run again, which it may not once the destructors have
+ * run PTHREAD_DESTRUCTOR_ITERATIONS times, leaving the arena out of the pool.
+ */
+static __thread int exiting;
+static arena *teardown_arena;
+static pthread_mutex_t teardown_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void *map(size_t bytes)
 {
 	return mmap(0,
 		    bytes,
 		    PROT_READ|PROT_WRITE,
-		    MAP_SHARED|MAP_ANONYMOUS,
+		    MAP_PRIVATE|MAP_ANONYMOUS,
 		    -1,
 		    0);
 }
 
-node *search_size(node *list, size_t size)
+/**
+ * Maps memory aligned to SLAB_SIZE by over-allocating and trimming the ends
+ * @param bytes number of bytes, a multiple of the page size
+ * @return the memory, or NULL if out of memory
+ */
+void *map_aligned(size_t bytes)
 {
-	node *curr = list;
-	while (curr != NULL && curr->size < size) {
-		curr = curr->next;
+	void *ptr = map(bytes + SLAB_SIZE);
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+
+	uintptr_t start = (uintptr_t) ptr;
+	uintptr_t aligned = (start + SLAB_SIZE - 1) & ~((uintptr_t) SLAB_SIZE - 1);
+	if (aligned > start) {
+		munmap(ptr, aligned - start);
+	}
+	if (start + SLAB_SIZE > aligned) {
+		munmap((void *) (aligned + bytes), start + SLAB_SIZE - aligned);
 	}
 
-	return curr;
+	stat_add(&stat_mapped, bytes);
+	return (void *) aligned;
 }
 
 /**
- * Adds a page of the given number of bytes to the global free list
- * @param bytes number of bytes
+ * Finds the slab holding a block. No block starts a slab, as the header is
+ * there, so a block on a slab boundary belongs to the slab before it.
+ * @param ptr the block
+ * @return its slab header
  */
-void fl_add_page(size_t bytes)
+static inline slab *slab_of(void *ptr)
 {
-	void *ptr = map(bytes + sizeof(node));
+	return (slab *) (((uintptr_t) ptr - 1) & ~((uintptr_t) SLAB_SIZE - 1));
+}
 
-	node *new_node = (node *) ptr;
-	new_node->size = bytes;
+#ifdef OPT_MALLOC_HIST
+/*
+ * Allocation latency in TSC cycles, counted per arena in log-linear
+ * histograms: HIST_SUB buckets for each power of two, so a bucket's bounds are
+ * within 12.5% of each other. Calls served from a cache and calls that had to
+ * refill it are kept apart, per size class, and large allocations on their
+ * own. Built in only with -DOPT_MALLOC_HIST (make HIST=1).
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
 
-	if (aren.free_list == NULL) {
-		aren.free_list = new_node;
-	} else {
-		new_node->next = aren.free_list;
-		aren.free_list = new_node;
+typedef struct hist_t {
+	unsigned long fast[NUM_CLASSES][HIST_BUCKETS];
+	unsigned long refill[NUM_CLASSES][HIST_BUCKETS];
+	unsigned long large[HIST_BUCKETS];
+} hist;
+
+/* a clock reading taken with the first arena, to convert cycles to time */
+static uint64_t hist_ticks0;
+static struct timespec hist_time0;
+
+static inline uint64_t hist_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Counts a call that started at the given clock reading
+ * @param row the histogram of the call's class and path
+ * @param start hist_now() when the call started
+ */
+static inline void hist_record(unsigned long *row, uint64_t start)
+{
+	uint64_t v = hist_now() - start;
+	if (v < HIST_SUB) {
+		row[v]++;
+		return;
 	}
+	int e = 63 - __builtin_clzll(v);
+	row[(e - HIST_SUB_BITS + 1) * HIST_SUB +
+	    ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1))]++;
 }
 
 /**
- * Takes the given amount of bytes from the target node
- * @param target_node the target to take memory from
- * @param bytes number of bytes to take
- * @return the pointer to memory taken
+ * Finds the smallest latency past a bucket
+ * @param b the bucket
+ * @return the bucket's upper bound, in cycles
  */
-void *get_memory(node *target_node, size_t bytes)
+static double hist_upper(int b)
 {
-	void *ret_val = target_node;
+	b++;
+	if (b < HIST_SUB) {
+		return b;
+	}
+	int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+	return (double) (HIST_SUB + b % HIST_SUB) * (double) (1ULL << (e - HIST_SUB_BITS));
+}
+
+/**
+ * Prints the call count and percentiles of one histogram, if it has calls
+ * @param size the size class, or NULL for large allocations
+ * @param path which path the calls took
+ * @param row the histogram
+ * @param ns_per_tick nanoseconds per cycle
+ */
+static void hist_print_row(const char *size, const char *path, unsigned long *row,
+			   double ns_per_tick)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+	unsigned long total = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		total += row[b];
+	}
+	if (total == 0) {
+		return;
+	}
 
-	node *new_node = (node *) (ret_val + bytes);
-	new_node->size = target_node->size - bytes;
-	new_node->next = target_node->next;
+	fprintf(stderr, "%8s %-7s %12lu", size, path, total);
+	int b = 0;
+	unsigned long seen = row[0];
+	for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+		unsigned long rank = (unsigned long) (quantiles[q] * total + 0.999999);
+		while (seen < rank) {
+			seen += row[++b];
+		}
+		fprintf(stderr, " %9.0f", hist_upper(b) * ns_per_tick);
+	}
+	fprintf(stderr, "\n");
+}
 
-	if (target_node == aren.free_list) {
-		aren.free_list = new_node;
+/**
+ * Prints percentiles of the allocation latency of all arenas, in
+ * nanoseconds, by size class and path. Each figure is the upper bound of the
+ * bucket the percentile falls in.
+ */
+static void hist_print(void)
+{
+	hist *sum = map(sizeof(hist));
+	if (sum == MAP_FAILED) {
+		return;
+	}
+	unsigned long *out = (unsigned long *) sum;
+	for (arena *a = arenas; a != NULL; a = a->next_arena) {
+		unsigned long *in = (unsigned long *) a->hist;
+		for (size_t i = 0; i < sizeof(hist) / sizeof(*out); i++) {
+			out[i] += in[i];
+		}
 	}
 
-	target_node->size = bytes;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t ticks = hist_now() - hist_ticks0;
+	double ns = (ts.tv_sec - hist_time0.tv_sec) * 1e9 + (ts.tv_nsec - hist_time0.tv_nsec);
+	double ns_per_tick = ticks > 0 ? ns / ticks : 1;
 
-	return ret_val;
+	fprintf(stderr, "\n== opt malloc latency (ns) ==\n");
+	fprintf(stderr, "%8s %-7s %12s %9s %9s %9s %9s %9s\n",
+		"size", "path", "calls", "p50", "p90", "p99", "p99.9", "max");
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		char size[16];
+		snprintf(size, sizeof(size), "%d", class_size[bin]);
+		hist_print_row(size, "fast", sum->fast[bin], ns_per_tick);
+		hist_print_row(size, "refill", sum->refill[bin], ns_per_tick);
+	}
+	hist_print_row("large", "large", sum->large, ns_per_tick);
+
+	munmap(sum, sizeof(hist));
+}
+#endif
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Hands the pages of an empty slab back to the OS. The first page stays, so
+ * the header survives and the slab can be reused; the rest fault back in as
+ * zero pages when it is.
+ * @param sl the slab
+ */
+void release_slab(slab *sl)
+{
+	madvise((char *) sl + PAGE_SIZE, SLAB_SIZE - PAGE_SIZE, MADV_DONTNEED);
+	sl->released = 1;
+	stat_add(&stat_released, SLAB_SIZE - PAGE_SIZE);
+}
+
+/**
+ * Sets up a slab for a class, with every block still to be carved
+ * @param sl the slab
+ * @param cls its size class
+ */
+void format_slab(slab *sl, int cls)
+{
+	sl->owner = aren;
+	sl->size = class_size[cls];
+	sl->cls = cls;
+	sl->used = 0;
+	sl->released = 0;
+	sl->free = NULL;
+	sl->bump = (char *) (sl + 1);
+}
+
+/**
+ * Tells whether a slab has no block left to hand out, freed or uncarved
+ * @param sl the slab
+ */
+static inline int slab_full(slab *sl)
+{
+	return sl->free == NULL && sl->bump + sl->size > (char *) sl + SLAB_SIZE;
 }
 
 /**
- * Init the free list for that size with some number of chunks of that size
- * @param bytes 16 or 24 or 64
+ * Gets a slab for the given class, reusing an empty one of this arena if
+ * there is one and otherwise cutting it from the arena's chunk, mapping a new
+ * chunk when the current one is used up
+ * @param cls the size class
+ * @return the slab, or NULL if out of memory
  */
-void init_fl(size_t bytes)
+slab *new_slab(int cls)
 {
-	size_t total_size = (bytes + sizeof(node)) * SEGREGATED_LIST_ALLOC_SIZE;
+	pthread_mutex_lock(&aren->empty_lock);
+	slab *sl = aren->empty;
+	if (sl != NULL) {
+		aren->empty = sl->next;
+	}
+	pthread_mutex_unlock(&aren->empty_lock);
+
+	if (sl == NULL) {
+		if (aren->chunk_next == aren->chunk_end) {
+			char *ch = map_aligned(CHUNK_SIZE);
+			if (ch == NULL) {
+				return NULL;
+			}
+			aren->chunk_next = ch;
+			aren->chunk_end = ch + CHUNK_SIZE;
+		}
 
-	node *result = search_size(aren.free_list, total_size);
-	if (result == NULL) {
-		fl_add_page(BIG_SIZE);
-		result = aren.free_list;
+		sl = (slab *) aren->chunk_next;
+		aren->chunk_next += SLAB_SIZE;
+		stat_add(&stat_slabs, SLAB_SIZE);
+	} else if (sl->released) {
+		stat_add(&stat_released, -(long) (SLAB_SIZE - PAGE_SIZE));
+	}
+
+	format_slab(sl, cls);
+	return sl;
+}
+
+/**
+ * Puts a slab that has just got a free block at the front of its bin
+ * @param sl the slab
+ */
+static inline void bin_push(slab *sl)
+{
+	slab **bin = &aren->bins[sl->cls];
+	sl->prev = NULL;
+	sl->next = *bin;
+	if (*bin != NULL) {
+		(*bin)->prev = sl;
 	}
+	*bin = sl;
+}
 
-	void *ptr = get_memory(result, total_size);
-	if (bytes == 16) {
-		aren.free_list_16 = ptr;
-	} else if (bytes == 24) {
-		aren.free_list_24 = ptr;
+/**
+ * Takes a slab out of its bin
+ * @param sl the slab
+ */
+static inline void bin_unlink(slab *sl)
+{
+	if (sl->prev != NULL) {
+		sl->prev->next = sl->next;
 	} else {
-		aren.free_list_64 = ptr;
+		aren->bins[sl->cls] = sl->next;
 	}
+	if (sl->next != NULL) {
+		sl->next->prev = sl->prev;
+	}
+}
 
-	node *list = (node *) ptr;
-	list->size = bytes;
+/**
+ * Moves a slab with no blocks in use to the arena's empty list. Without a
+ * scavenger its pages go back to the OS right away; with one they stay
+ * until the slab has been empty for decay_ms.
+ * @param sl the slab, already out of its bin
+ */
+void retire_slab(slab *sl)
+{
+	if (decay_ms < 0) {
+		release_slab(sl);
+	} else {
+		sl->empty_since = now_ms();
+	}
 
-	node *curr = list;
-	for (int i = 1; i < SEGREGATED_LIST_ALLOC_SIZE; i++) {
-		node *new_node = (void *) (curr + 1) + bytes;
+	pthread_mutex_lock(&aren->empty_lock);
+	sl->next = aren->empty;
+	aren->empty = sl;
+	pthread_mutex_unlock(&aren->empty_lock);
+}
 
-		new_node->size = bytes;
-		curr->next = new_node;
-		new_node->next = NULL;
+/**
+ * Rounds the length of a large span up to its bucket: whole pages up to 4
+ * pages, then a quarter of the power of two below, so that spans the cache
+ * hands out waste less than a quarter of their length. Lengths past the
+ * cache's are only rounded to pages.
+ * @param total length of the span in bytes
+ * @return the rounded length
+ */
+static inline size_t large_round(size_t total)
+{
+	total = (total + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+	if (total <= 4 * PAGE_SIZE || total > LARGE_CACHE_PAGES * PAGE_SIZE) {
+		return total;
+	}
+	size_t step = ((size_t) 1 << (63 - __builtin_clzll(total - 1))) / 4;
+	return (total + step - 1) & ~(step - 1);
+}
 
-		curr = new_node;
+/**
+ * @param total length of a span, as rounded by large_round, of up to
+ *        LARGE_CACHE_PAGES pages
+ * @return the span's bucket in the large cache
+ */
+static inline int large_bucket(size_t total)
+{
+	size_t pages = total / PAGE_SIZE;
+	if (pages <= 4) {
+		return pages;
 	}
+	int lg = 63 - __builtin_clzll(pages - 1);
+	return 4 + (lg - 2) * 4 + (pages - ((size_t) 1 << lg)) / ((size_t) 1 << (lg - 2));
 }
 
-void *opt_malloc_16()
+/**
+ * Takes the smallest cached large span at least as long as asked, from the
+ * bucket of that length or failing that one of the LARGE_CACHE_FIT next ones
+ * @param total length of the span in bytes, as rounded by large_round
+ * @return the span, or NULL if none is cached
+ */
+slab *large_cache_take(size_t total)
 {
-	if (aren.free_list_16 == NULL) {
-		init_fl(16);
+	if (total > LARGE_CACHE_PAGES * PAGE_SIZE) {
+		return NULL;
 	}
+	int first = large_bucket(total);
+	int last = first + LARGE_CACHE_FIT < LARGE_BUCKETS ?
+		first + LARGE_CACHE_FIT : LARGE_BUCKETS - 1;
 
-	void *ret_val = aren.free_list_16 + 1;
-	aren.free_list_16 = aren.free_list_16->next;
+	slab *sl = NULL;
+	pthread_mutex_lock(&large_lock);
+	for (int bucket = first; bucket <= last; bucket++) {
+		sl = large_cache[bucket];
+		if (sl != NULL) {
+			large_cache[bucket] = sl->next;
+			large_cached -= sl->size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&large_lock);
 
-	return ret_val;
+	return sl;
+}
+
+/**
+ * Keeps a freed large span for reuse, if it is small enough, was never
+ * grown, and the cache has room for it
+ * @param sl the span
+ * @return 1 if the span was cached, 0 if the caller should unmap it
+ */
+int large_cache_put(slab *sl)
+{
+	/* grown spans, of any length between buckets, are rarely asked for again */
+	if (sl->size > LARGE_CACHE_PAGES * PAGE_SIZE || sl->used) {
+		return 0;
+	}
+	int bucket = large_bucket(sl->size);
+	if (decay_ms >= 0) {
+		sl->empty_since = now_ms();
+	}
+
+	pthread_mutex_lock(&large_lock);
+	int cached = large_cached + sl->size <= LARGE_CACHE_BYTES;
+	if (cached) {
+		sl->next = large_cache[bucket];
+		large_cache[bucket] = sl;
+		large_cached += sl->size;
+	}
+	pthread_mutex_unlock(&large_lock);
+
+	return cached;
 }
 
-void *opt_malloc_24()
+/**
+ * Unmaps the cached large spans that have been idle for decay_ms
+ * @param now the time in milliseconds
+ */
+void large_cache_trim(uint64_t now)
 {
-	if (aren.free_list_24 == NULL) {
-		init_fl(24);
+	pthread_mutex_lock(&large_lock);
+	for (int bucket = 0; bucket < LARGE_BUCKETS; bucket++) {
+		slab **link = &large_cache[bucket];
+		while (*link != NULL) {
+			slab *sl = *link;
+			if (now - sl->empty_since >= (uint64_t) decay_ms) {
+				*link = sl->next;
+				large_cached -= sl->size;
+				stat_add(&stat_mapped, -(long) sl->size);
+				stat_add(&stat_large, -(long) sl->size);
+				munmap(sl, sl->size);
+			} else {
+				link = &sl->next;
+			}
+		}
 	}
+	pthread_mutex_unlock(&large_lock);
+}
 
-	void *ret_val = aren.free_list_24 + 1;
-	aren.free_list_24 = aren.free_list_24->next;
+/**
+ * Releases the slabs of every arena that have been empty for decay_ms, and
+ * the cached large spans idle as long, waking up a few times per decay period
+ */
+void *scavenge(void *arg)
+{
+	(void) arg;
+	long period = decay_ms / 4 > 10 ? decay_ms / 4 : 10;
+	struct timespec nap = { period / 1000, (period % 1000) * 1000000 };
 
-	return ret_val;
+	for (;;) {
+		nanosleep(&nap, NULL);
+		uint64_t now = now_ms();
+
+		pthread_mutex_lock(&arenas_lock);
+		arena *first = arenas;
+		pthread_mutex_unlock(&arenas_lock);
+
+		for (arena *a = first; a != NULL; a = a->next_arena) {
+			pthread_mutex_lock(&a->empty_lock);
+			for (slab *sl = a->empty; sl != NULL; sl = sl->next) {
+				if (!sl->released && now - sl->empty_since >= (uint64_t) decay_ms) {
+					release_slab(sl);
+				}
+			}
+			pthread_mutex_unlock(&a->empty_lock);
+		}
+
+		large_cache_trim(now);
+	}
+
+	return NULL;
 }
 
-void *opt_malloc_64()
+/**
+ * Reads OPT_MALLOC_DECAY_MS and starts the scavenger if it is set
+ */
+void start_scavenger(void)
 {
-	if (aren.free_list_64 == NULL) {
-		init_fl(64);
+	char *env = getenv("OPT_MALLOC_DECAY_MS");
+	if (env == NULL) {
+		return;
 	}
+	decay_ms = atol(env);
 
-	void *ret_val = aren.free_list_64 + 1;
-	aren.free_list_64 = aren.free_list_64->next;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, scavenge, NULL) != 0) {
+		decay_ms = -1;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/**
+ * Gives a large block its own span, taken from the cache or mapped
+ * @param bytes size of the block
+ * @param align alignment of the block, a power of two up to SLAB_SIZE / 2
+ * @param reserve bytes to leave free between the span's header and the block
+ * @return the block, or NULL if out of memory
+ */
+void *opt_malloc_big(size_t bytes, size_t align, size_t reserve)
+{
+	if (bytes > SIZE_MAX / 2) {
+		return NULL;
+	}
+#ifdef OPT_MALLOC_HIST
+	uint64_t start = hist_now();
+#endif
+	/* the block stays inside the span's first slab, so slab_of finds it */
+	size_t offset = (sizeof(slab) + reserve + align - 1) & ~(align - 1);
+	size_t total = large_round(offset + bytes);
+	slab *sl = large_cache_take(total);
+	if (sl == NULL) {
+		sl = map_aligned(total);
+		if (sl == NULL) {
+			return NULL;
+		}
+		stat_add(&stat_large, total);
+		sl->size = total;
+	}
+
+	aren->large_nmalloc++;
+	aren->large_taken += sl->size;
+	sl->owner = aren;
+	sl->cls = LARGE_CLASS;
+
+#ifdef OPT_MALLOC_HIST
+	hist_record(aren->hist->large, start);
+#endif
+	return (char *) sl + offset;
+}
+
+/**
+ * Gives a block aligned to more than SLAB_SIZE / 2 a span of its own. The
+ * block starts one slab into the span, which is mapped with room to spare and
+ * trimmed so that the block falls on the alignment.
+ * @param bytes size of the block
+ * @param align alignment of the block, a power of two above SLAB_SIZE / 2
+ * @return the block, or NULL if out of memory
+ */
+void *opt_malloc_overaligned(size_t bytes, size_t align)
+{
+	if (bytes > SIZE_MAX / 2 || align > SIZE_MAX / 4) {
+		return NULL;
+	}
+	size_t total = large_round(SLAB_SIZE + bytes);
+	size_t mapped = total + align - SLAB_SIZE;
+	char *base = map_aligned(mapped);
+	if (base == NULL) {
+		return NULL;
+	}
+
+	char *block = (char *) (((uintptr_t) base + SLAB_SIZE + align - 1) & ~((uintptr_t) align - 1));
+	slab *sl = (slab *) (block - SLAB_SIZE);
+	if ((char *) sl > base) {
+		munmap(base, (char *) sl - base);
+	}
+	if ((char *) sl + total < base + mapped) {
+		munmap((char *) sl + total, base + mapped - ((char *) sl + total));
+	}
+	stat_add(&stat_mapped, -(long) (mapped - total));
+	stat_add(&stat_large, total);
+
+	aren->large_nmalloc++;
+	aren->large_taken += total;
+	sl->owner = aren;
+	sl->size = total;
+	sl->cls = LARGE_CLASS;
+	return block;
+}
+
+/**
+ * Gives a block the heap profiler samples a span of its own, whatever its
+ * size, so that freeing it finds its record from the span's class alone and
+ * unsampled blocks pay nothing
+ * @param bytes size of the block
+ * @param align alignment of the block, a power of two up to SLAB_SIZE / 2
+ * @return the block, or NULL if out of memory
+ */
+void *opt_malloc_sampled(size_t bytes, size_t align)
+{
+	void *ptr = opt_malloc_big(bytes, align, sizeof(prof_sample));
+	if (ptr != NULL) {
+		slab *sl = slab_of(ptr);
+		sl->cls = SAMPLED_CLASS;
+		prof_record((prof_sample *) (sl + 1), bytes);
+	}
+	return ptr;
+}
+
+/**
+ * Returns a block of this arena to its slab, moving the slab back into its
+ * bin if it was full and out of it if it is now empty
+ * @param ptr_node the block
+ * @param sl the block's slab
+ */
+void free_local(node *ptr_node, slab *sl)
+{
+	int was_full = slab_full(sl);
+
+	ptr_node->next = sl->free;
+	sl->free = ptr_node;
+	sl->used--;
+
+	if (was_full) {
+		bin_push(sl);
+	} else if (sl->used == 0 && (sl->prev != NULL || sl->next != NULL)) {
+		/* the last slab of a class stays, so that a class going back and
+		 * forth between one and no blocks does not fault pages in each time */
+		bin_unlink(sl);
+		retire_slab(sl);
+	}
+}
+
+/**
+ * Returns every block other threads have freed to its slab
+ */
+void drain_remote_frees(void)
+{
+	node *list = __atomic_exchange_n(&aren->remote_free, NULL, __ATOMIC_ACQUIRE);
+	while (list != NULL) {
+		node *next = list->next;
+		free_local(list, slab_of(list));
+		list = next;
+	}
+}
+
+/**
+ * Returns a block to the slab it came from. Blocks of other arenas go on that
+ * arena's remote free list.
+ * @param ptr_node the block
+ * @param sl the block's slab
+ */
+void return_block(node *ptr_node, slab *sl)
+{
+	arena *owner = sl->owner;
+
+	if (owner != aren) {
+		ptr_node->next = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&owner->remote_free, &ptr_node->next,
+						    ptr_node, 1, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+		return;
+	}
+
+	free_local(ptr_node, sl);
+}
+
+/**
+ * Takes a block of the given size class from this arena's slabs
+ * @param bin the size class
+ * @return the block, or NULL if out of memory
+ */
+void *slab_alloc(int bin)
+{
+	slab *sl = aren->bins[bin];
+	if (sl == NULL) {
+		sl = new_slab(bin);
+		if (sl == NULL) {
+			return NULL;
+		}
+		bin_push(sl);
+	}
+
+	node *ret_val = sl->free;
+	if (ret_val != NULL) {
+		sl->free = ret_val->next;
+	} else {
+		ret_val = (node *) sl->bump;
+		sl->bump += sl->size;
+	}
+	sl->used++;
+	if (slab_full(sl)) {
+		bin_unlink(sl);
+	}
 
 	return ret_val;
 }
 
-void *opt_malloc_big(size_t bytes)
+/**
+ * Hands a batch of class_batch blocks to the transfer cache
+ * @param bin the size class
+ * @param blocks the blocks
+ * @return 1 if the transfer cache took the batch, 0 if it is full
+ */
+int transfer_put(int bin, void **blocks)
+{
+	transfer *tc = &transfers[bin];
+	int n = class_batch[bin];
+
+	pthread_mutex_lock(&tc->lock);
+	int taken = tc->count + n <= TRANSFER_BATCHES * n;
+	if (taken) {
+		memcpy(&tc->blocks[tc->count], blocks, n * sizeof(void *));
+		tc->count += n;
+	}
+	pthread_mutex_unlock(&tc->lock);
+
+	return taken;
+}
+
+/**
+ * Takes a batch of class_batch blocks from the transfer cache
+ * @param bin the size class
+ * @param blocks where to put the blocks
+ * @return 1 if a batch was taken, 0 if there is none
+ */
+int transfer_take(int bin, void **blocks)
+{
+	transfer *tc = &transfers[bin];
+	int n = class_batch[bin];
+
+	/* an unlocked peek keeps threads off the lock while the cache is empty */
+	if (__atomic_load_n(&tc->count, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&tc->lock);
+	int taken = tc->count >= n;
+	if (taken) {
+		tc->count -= n;
+		memcpy(blocks, &tc->blocks[tc->count], n * sizeof(void *));
+	}
+	pthread_mutex_unlock(&tc->lock);
+
+	return taken;
+}
+
+/**
+ * Gets up to a batch of free blocks, from the transfer cache if it has a
+ * batch and otherwise from this arena's slabs
+ * @param bin the size class
+ * @param blocks where to put the blocks, room for class_batch
+ * @return the number of blocks, 0 if out of memory
+ */
+int fetch_batch(int bin, void **blocks)
+{
+#ifdef OPT_MALLOC_HIST
+	aren->refills++;
+#endif
+	if (transfer_take(bin, blocks)) {
+		return class_batch[bin];
+	}
+
+	if (aren->bins[bin] == NULL) {
+		drain_remote_frees();
+	}
+
+	int count = 0;
+	while (count < class_batch[bin]) {
+		void *block = slab_alloc(bin);
+		if (block == NULL) {
+			break;
+		}
+		blocks[count++] = block;
+	}
+	return count;
+}
+
+/**
+ * Gets rid of free blocks a cache has no room for, handing them to the
+ * transfer cache if they make a batch and it has room, and otherwise
+ * returning them to their slabs
+ * @param bin the size class
+ * @param blocks the blocks
+ * @param count how many there are
+ */
+void release_batch(int bin, void **blocks, int count)
 {
-	header *hdr = map(bytes + sizeof(header));
-	hdr->size = bytes;
+	if (count == class_batch[bin] && transfer_put(bin, blocks)) {
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		return_block(blocks[i], slab_of(blocks[i]));
+	}
+}
 
-	return hdr + 1;
+/**
+ * Takes a block of the given size class from the thread cache
+ * @param bin the size class
+ * @return the block, or NULL if out of memory
+ */
+static inline void *cache_alloc(int bin)
+{
+	void **mag = &aren->cache[class_cache_off[bin]];
+	int count = aren->cache_count[bin];
+
+	if (count == 0) {
+		count = fetch_batch(bin, mag);
+		if (count == 0) {
+			return NULL;
+		}
+	}
+
+	aren->cache_count[bin] = count - 1;
+	return mag[count - 1];
+}
+
+/**
+ * Puts a small block in this thread's cache, whichever arena it came from
+ * @param ptr the block
+ * @param bin its size class
+ */
+static inline void cache_free(void *ptr, int bin)
+{
+	void **mag = &aren->cache[class_cache_off[bin]];
+	int count = aren->cache_count[bin];
+
+	if (count == class_cache_max[bin]) {
+		count -= class_batch[bin];
+		release_batch(bin, &mag[count], class_batch[bin]);
+	}
+
+	mag[count] = ptr;
+	aren->cache_count[bin] = count + 1;
 }
 
-int which_bin(size_t bytes)
+#ifdef HAVE_RSEQ
+/*
+ * Restartable sequences on the per-CPU caches. Each reads the CPU number the
+ * kernel keeps in this thread's rseq area, finds that CPU's array for the
+ * class, and commits by storing the new count as its last instruction. If
+ * the thread is preempted, migrated or signalled before the commit, the
+ * kernel moves it to the abort handler, which starts the sequence over, so
+ * no other thread on the CPU can have seen a half-done update.
+ */
+#define RSEQ_START(abort)						\
+	".pushsection __rseq_cs, \"aw\"\n\t"				\
+	".balign 32\n\t"							\
+	"3:\n\t"								\
+	".long 0, 0\n\t"							\
+	".quad 1f, 2f - 1f, 4f\n\t"					\
+	".popsection\n\t"							\
+	".pushsection __rseq_failure, \"ax\"\n\t"				\
+	".long %c[sig]\n\t"						\
+	"4:\n\t"								\
+	"jmp %l[" #abort "]\n\t"						\
+	".popsection\n\t"							\
+	"leaq 3b(%%rip), %%rax\n\t"					\
+	"movq %%rax, %c[cs](%[rs])\n\t"					\
+	"1:\n\t"								\
+	"movl %c[cpu](%[rs]), %%eax\n\t"					\
+	"imulq %[block], %%rax\n\t"						\
+	"addq %[base], %%rax\n\t"
+
+#define RSEQ_INPUTS							\
+	[rs] "r" ((char *) __builtin_thread_pointer() + __rseq_offset),	\
+	[base] "r" (pcpu_base + pcpu_off[bin]),				\
+	[block] "r" (pcpu_block),					\
+	[cs] "i" (offsetof(struct rseq, rseq_cs)),			\
+	[cpu] "i" (offsetof(struct rseq, cpu_id)),			\
+	[sig] "i" (RSEQ_SIG)
+
+static inline int rseq_pop(int bin, void **out)
 {
-	for (int i = 0; i < NUM_BINS; i++) {
-		if (bytes <= sizes[i]) {
-			return i;
+retry:
+	asm volatile goto (
+		RSEQ_START(abort)
+		"movq (%%rax), %%rcx\n\t"
+		"testq %%rcx, %%rcx\n\t"
+		"jz %l[empty]\n\t"
+		"movq (%%rax, %%rcx, 8), %%rdx\n\t"
+		"movq %%rdx, (%[out])\n\t"
+		"decq %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"
+		"2:\n\t"
+		:
+		: RSEQ_INPUTS, [out] "r" (out)
+		: "rax", "rcx", "rdx", "memory", "cc"
+		: abort, empty);
+	return 1;
+abort:
+	goto retry;
+empty:
+	return 0;
+}
+
+static inline int rseq_push(int bin, void *ptr)
+{
+retry:
+	asm volatile goto (
+		RSEQ_START(abort)
+		"movq (%%rax), %%rcx\n\t"
+		"cmpq %[cap], %%rcx\n\t"
+		"jae %l[full]\n\t"
+		"movq %[ptr], 8(%%rax, %%rcx, 8)\n\t"
+		"incq %%rcx\n\t"
+		"movq %%rcx, (%%rax)\n\t"
+		"2:\n\t"
+		:
+		: RSEQ_INPUTS, [ptr] "r" (ptr), [cap] "r" ((size_t) class_cache_max[bin])
+		: "rax", "rcx", "memory", "cc"
+		: abort, full);
+	return 1;
+abort:
+	goto retry;
+full:
+	return 0;
+}
+#endif
+
+/**
+ * Without rseq, finds this thread's current CPU and locks its caches. The
+ * thread may move to another CPU while it holds the lock, which is harmless;
+ * the lock is nearly always uncontended.
+ * @return the CPU's block
+ */
+static char *pcpu_lock(void)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= ncpus) {
+		cpu = 0;
+	}
+
+	char *block = pcpu_base + cpu * pcpu_block;
+	int *lock = (int *) block;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+			sched_yield();
 		}
 	}
+	return block;
+}
 
-	return -1;
+static void pcpu_unlock(char *block)
+{
+	__atomic_store_n((int *) block, 0, __ATOMIC_RELEASE);
 }
 
-void init_bin(int bin_number)
+/**
+ * Takes a free block of a class from this CPU's cache
+ * @param bin the size class
+ * @param out set to the block
+ * @return 1 on success, 0 if the cache is empty
+ */
+static inline int pcpu_pop(int bin, void **out)
 {
-	size_t bytes = sizes[bin_number];
+#ifdef HAVE_RSEQ
+	if (use_rseq) {
+		return rseq_pop(bin, out);
+	}
+#endif
+	char *block = pcpu_lock();
+	size_t *count = (size_t *) (block + pcpu_off[bin]);
+	int popped = *count > 0;
+	if (popped) {
+		*out = (void *) count[(*count)--];
+	}
+	pcpu_unlock(block);
+	return popped;
+}
 
-	size_t each_node = sizeof(node) + bytes;
-	size_t total = each_node * BIN_ALLOC_SIZE;
+/**
+ * Puts a free block of a class in this CPU's cache
+ * @param bin the size class
+ * @param ptr the block
+ * @return 1 on success, 0 if the cache is full
+ */
+static inline int pcpu_push(int bin, void *ptr)
+{
+#ifdef HAVE_RSEQ
+	if (use_rseq) {
+		return rseq_push(bin, ptr);
+	}
+#endif
+	char *block = pcpu_lock();
+	size_t *count = (size_t *) (block + pcpu_off[bin]);
+	int pushed = *count < class_cache_max[bin];
+	if (pushed) {
+		count[++(*count)] = (size_t) ptr;
+	}
+	pcpu_unlock(block);
+	return pushed;
+}
 
-	node *result = search_size(aren.free_list, total);
-	if (result == NULL) {
-		fl_add_page(BIG_SIZE);
-		result = aren.free_list;
+/**
+ * Takes a block from this CPU's cache, refilling it with a batch from the
+ * transfer cache or this thread's arena when it is empty
+ * @param bin the size class
+ * @return the block, or NULL if out of memory
+ */
+void *pcpu_alloc(int bin)
+{
+	void *ptr;
+	if (pcpu_pop(bin, &ptr)) {
+		return ptr;
 	}
 
-	void *ptr = get_memory(result, total);
-	aren.bins[bin_number] = ptr;
+	void *blocks[MAX_BATCH];
+	int count = fetch_batch(bin, blocks);
+	if (count == 0) {
+		return NULL;
+	}
 
-	node *list = (node *) ptr;
-	list->size = bytes;
-	list->next = NULL;
+	for (int i = 1; i < count; i++) {
+		if (!pcpu_push(bin, blocks[i])) {
+			return_block(blocks[i], slab_of(blocks[i]));
+		}
+	}
+	return blocks[0];
+}
 
-	node *curr = list;
-	for (int i = 1; i < BIN_ALLOC_SIZE; i++) {
-		node *new_node = (void *) (curr + 1) + bytes;
+/**
+ * Puts a block in this CPU's cache, first moving a batch out to the transfer
+ * cache or the slabs when it is full
+ * @param ptr the block
+ * @param bin its size class
+ */
+void pcpu_free(void *ptr, int bin)
+{
+	if (pcpu_push(bin, ptr)) {
+		return;
+	}
 
-		new_node->size = bytes;
-		curr->next = new_node;
+	void *blocks[MAX_BATCH];
+	int count = 0;
+	while (count < class_batch[bin] && pcpu_pop(bin, &blocks[count])) {
+		count++;
+	}
+	release_batch(bin, blocks, count);
 
-		curr = new_node;
+	if (!pcpu_push(bin, ptr)) {
+		return_block(ptr, slab_of(ptr));
 	}
 }
 
-void *opt_malloc_bin(size_t bytes)
+/**
+ * Reads OPT_MALLOC_PERCPU and, if it is set, maps the per-CPU caches
+ */
+void init_percpu(void)
 {
-	int bin = which_bin(bytes);
+	if (getenv("OPT_MALLOC_PERCPU") == NULL) {
+		return;
+	}
 
-	if (aren.bins[bin] == NULL) {
-		init_bin(bin);
+	size_t off = 64;
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		pcpu_off[bin] = off;
+		off += (1 + class_cache_max[bin]) * sizeof(void *);
+	}
+	pcpu_block = (off + 63) & ~(size_t) 63;
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (ncpus < 1) {
+		ncpus = 1;
 	}
 
-	void *ret_val = aren.bins[bin] + 1;
-	aren.bins[bin] = aren.bins[bin]->next;
+	pcpu_base = map(ncpus * pcpu_block);
+	if (pcpu_base != MAP_FAILED) {
+		stat_add(&stat_mapped, ncpus * pcpu_block);
+		percpu = 1;
+	}
+}
 
-	return ret_val;
+/**
+ * Takes a block of the given size class from this CPU's or thread's cache
+ * @param bin the size class
+ * @return the block, or NULL if out of memory
+ */
+void *opt_malloc_bin(int bin)
+{
+	aren->nmalloc[bin]++;
+#ifdef OPT_MALLOC_HIST
+	uint64_t start = hist_now();
+	unsigned long refills = aren->refills;
+	void *ptr = percpu ? pcpu_alloc(bin) : cache_alloc(bin);
+	hist_record(aren->refills == refills ? aren->hist->fast[bin] :
+		    aren->hist->refill[bin], start);
+	return ptr;
+#else
+	if (percpu) {
+		return pcpu_alloc(bin);
+	}
+	return cache_alloc(bin);
+#endif
 }
 
-void *opt_malloc(size_t bytes)
+/*
+ * Every lock is held across fork, so the child does not inherit one taken by
+ * a thread that does not exist there.
+ */
+void fork_prepare(void)
 {
-	if (bytes == 16) {
-		return opt_malloc_16();
+	pthread_mutex_lock(&teardown_lock);
+	pthread_mutex_lock(&arenas_lock);
+	for (arena *a = arenas; a != NULL; a = a->next_arena) {
+		pthread_mutex_lock(&a->empty_lock);
+	}
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		pthread_mutex_lock(&transfers[bin].lock);
 	}
+	pthread_mutex_lock(&large_lock);
+	prof_fork_prepare();
+	if (percpu) {
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			while (__atomic_exchange_n((int *) (pcpu_base + cpu * pcpu_block), 1,
+						   __ATOMIC_ACQUIRE))
+				sched_yield();
+		}
+	}
+}
 
-	if (bytes == 24) {
-		return opt_malloc_24();
+void fork_parent(void)
+{
+	if (percpu) {
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			pcpu_unlock(pcpu_base + cpu * pcpu_block);
+		}
+	}
+	prof_fork_parent();
+	pthread_mutex_unlock(&large_lock);
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		pthread_mutex_unlock(&transfers[bin].lock);
+	}
+	for (arena *a = arenas; a != NULL; a = a->next_arena) {
+		pthread_mutex_unlock(&a->empty_lock);
 	}
+	pthread_mutex_unlock(&arenas_lock);
+	pthread_mutex_unlock(&teardown_lock);
+}
 
-	if (bytes == 64) {
-		return opt_malloc_64();
+void fork_child(void)
+{
+	if (percpu) {
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			pcpu_unlock(pcpu_base + cpu * pcpu_block);
+		}
+	}
+	prof_fork_child();
+	pthread_mutex_init(&teardown_lock, NULL);
+	pthread_mutex_init(&large_lock, NULL);
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		pthread_mutex_init(&transfers[bin].lock, NULL);
 	}
+	for (arena *a = arenas; a != NULL; a = a->next_arena) {
+		pthread_mutex_init(&a->empty_lock, NULL);
+	}
+	pthread_mutex_init(&arenas_lock, NULL);
+
+	/* the scavenger did not survive the fork */
+	decay_ms = -1;
+}
 
-	if (bytes > PAGE_SIZE) {
-		return opt_malloc_big(bytes);
+/**
+ * Thread-exit destructor of arena_key: puts the exiting thread's arena in the
+ * pool. Its thread cache is emptied back into the slabs and the blocks other
+ * threads freed into it are taken back first; any freed later wait on its
+ * remote free list for the thread that adopts it.
+ * @param ptr the arena
+ */
+void pool_arena(void *ptr)
+{
+	(void) ptr;
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		void **mag = &aren->cache[class_cache_off[bin]];
+		for (int i = 0; i < aren->cache_count[bin]; i++) {
+			return_block(mag[i], slab_of(mag[i]));
+		}
+		aren->cache_count[bin] = 0;
 	}
+	drain_remote_frees();
+
+	pthread_mutex_lock(&arenas_lock);
+	aren->next_pooled = arena_pool;
+	arena_pool = aren;
+	pthread_mutex_unlock(&arenas_lock);
+
+	/* later destructors that allocate use the teardown arena */
+	aren = NULL;
+	exiting = 1;
+}
 
-	return opt_malloc_bin(bytes);
+/**
+ * Maps a new arena and links it into the list of arenas
+ * @return the arena
+ */
+arena *new_arena(void)
+{
+	/* fresh mappings are zeroed, and the cache pages are touched only
+	 * as they fill */
+	arena *a = map(sizeof(arena));
+	stat_add(&stat_mapped, sizeof(arena));
+	pthread_mutex_init(&a->empty_lock, NULL);
+#ifdef OPT_MALLOC_HIST
+	a->hist = map(sizeof(hist));
+	stat_add(&stat_mapped, sizeof(hist));
+#endif
+
+	pthread_mutex_lock(&arenas_lock);
+	a->next_arena = arenas;
+	arenas = a;
+	pthread_mutex_unlock(&arenas_lock);
+	return a;
 }
 
-void opt_free_segregated(void *ptr)
+/**
+ * Gives an exiting thread the teardown arena, until teardown_end
+ * @return 1 if the thread is exiting and now holds the teardown arena, 0 if
+ *         it needs an arena of its own
+ */
+int teardown_begin(void)
 {
-	node *ptr_node = (node *)(ptr - sizeof(node));
-	if (ptr_node->size == 16) {
-		ptr_node->next = aren.free_list_16;
-		aren.free_list_16 = ptr_node;
-	} else if (ptr_node->size == 24) {
-		ptr_node->next = aren.free_list_24;
-		aren.free_list_24 = ptr_node;
-	} else {
-		ptr_node->next = aren.free_list_64;
-		aren.free_list_64 = ptr_node;
+	if (!exiting) {
+		return 0;
+	}
+	pthread_mutex_lock(&teardown_lock);
+	if (teardown_arena == NULL) {
+		teardown_arena = new_arena();
+	}
+	aren = teardown_arena;
+	return 1;
+}
+
+void teardown_end(void)
+{
+	aren = NULL;
+	pthread_mutex_unlock(&teardown_lock);
+}
+
+/**
+ * Gives this thread an arena on its first allocation, adopting a pooled one
+ * if there is one and otherwise mapping a new one and linking it into the list
+ * of arenas. The first arena also sets up the per-CPU caches, registers the
+ * fork handlers and the thread-exit destructor and starts the scavenger and
+ * the heap profiler, once aren is set so that the allocations pthread_atfork
+ * and pthread_create make find it.
+ */
+void init_arena(void)
+{
+	pthread_mutex_lock(&arenas_lock);
+	aren = arena_pool;
+	if (aren != NULL) {
+		arena_pool = aren->next_pooled;
+	}
+	pthread_mutex_unlock(&arenas_lock);
+
+	if (aren == NULL) {
+		aren = new_arena();
+	}
+
+	pthread_mutex_lock(&arenas_lock);
+	int first = !initialized;
+	if (first) {
+		pthread_key_create(&arena_key, pool_arena);
+		init_percpu();
+#ifdef OPT_MALLOC_HIST
+		hist_ticks0 = hist_now();
+		clock_gettime(CLOCK_MONOTONIC, &hist_time0);
+#endif
+		initialized = 1;
 	}
+	pthread_mutex_unlock(&arenas_lock);
+
+#ifdef HAVE_RSEQ
+	if (percpu && __rseq_size > 0) {
+		struct rseq *rs = (struct rseq *) ((char *) __builtin_thread_pointer() +
+						   __rseq_offset);
+		use_rseq = (int) rs->cpu_id >= 0 && (int) rs->cpu_id < ncpus;
+	}
+#endif
+
+	if (first) {
+		pthread_atfork(fork_prepare, fork_parent, fork_child);
+		start_scavenger();
+		prof_init();
+		if (getenv("OPT_MALLOC_STATS") != NULL) {
+			atexit(opt_printstats);
+		}
+#ifdef OPT_MALLOC_HIST
+		atexit(hist_print);
+#endif
+	}
+	pthread_setspecific(arena_key, aren);
 }
 
-void opt_free_big(header *hdr)
+void *opt_malloc(size_t bytes)
 {
-	munmap(hdr, hdr->size + sizeof(header));
+	if (aren == NULL && teardown_begin()) {
+		void *ptr = opt_malloc(bytes);
+		teardown_end();
+		return ptr;
+	}
+	if (aren == NULL) {
+		init_arena();
+	}
+
+	/* with profiling off, this one well-predicted branch is all it costs */
+	if (__builtin_expect(prof_rate != 0, 0) && prof_should_sample(bytes)) {
+		return opt_malloc_sampled(bytes, CLASS_GRANULE);
+	}
+
+	if (bytes > MAX_SMALL_SIZE) {
+		return opt_malloc_big(bytes, CLASS_GRANULE, 0);
+	}
+
+	return opt_malloc_bin(size_class(bytes));
 }
 
-void opt_free_bin(void *ptr)
+void *opt_memalign(size_t align, size_t bytes)
 {
-	node *ptr_node = (node *) (ptr - sizeof(node));
-	int bin = which_bin(ptr_node->size);
-	if (aren.bins[bin] != NULL) {
-		ptr_node->next = aren.bins[bin];
+	if (align <= CLASS_GRANULE) {
+		return opt_malloc(bytes);
+	}
+	if (aren == NULL && teardown_begin()) {
+		void *ptr = opt_memalign(align, bytes);
+		teardown_end();
+		return ptr;
+	}
+	if (aren == NULL) {
+		init_arena();
 	}
-	aren.bins[bin] = ptr_node;
+	if (align > SLAB_SIZE / 2) {
+		return opt_malloc_overaligned(bytes, align);
+	}
+
+	if (__builtin_expect(prof_rate != 0, 0) && prof_should_sample(bytes)) {
+		return opt_malloc_sampled(bytes, align);
+	}
+
+	/* blocks of a class start at multiples of its size past the 64-byte
+	 * slab header, so a class whose size align divides is aligned */
+	if (bytes <= MAX_SMALL_SIZE && align <= sizeof(slab)) {
+		for (int bin = size_class(bytes); bin < NUM_CLASSES; bin++) {
+			if (class_size[bin] % align == 0) {
+				return opt_malloc_bin(bin);
+			}
+		}
+	}
+
+	return opt_malloc_big(bytes, align, 0);
+}
+
+/**
+ * Puts a small block in this CPU's or thread's cache, whichever arena it
+ * came from
+ * @param ptr the block
+ * @param sl the block's slab
+ */
+void opt_free_bin(void *ptr, slab *sl)
+{
+	aren->nfree[sl->cls]++;
+	if (percpu) {
+		pcpu_free(ptr, sl->cls);
+		return;
+	}
+	cache_free(ptr, sl->cls);
 }
 
 void opt_free(void *ptr)
 {
-	header *hdr = ptr - sizeof(header);
-	if (hdr->size == 16 || hdr->size == 24 || hdr->size == 64) {
-		opt_free_segregated(ptr);
+	if (ptr == NULL) {
 		return;
 	}
 
-	if (hdr->size > PAGE_SIZE) {
-		opt_free_big(hdr);
+	if (aren == NULL && teardown_begin()) {
+		opt_free(ptr);
+		teardown_end();
 		return;
 	}
+	/* a thread may free before it ever allocates */
+	if (aren == NULL) {
+		init_arena();
+	}
+
+	slab *sl = slab_of(ptr);
+	if (sl->cls < 0) {
+		if (sl->cls == SAMPLED_CLASS) {
+			prof_forget((prof_sample *) (sl + 1));
+			sl->cls = LARGE_CLASS;
+		}
+		aren->large_nfree++;
+		aren->large_given += sl->size;
+		if (!large_cache_put(sl)) {
+			stat_add(&stat_mapped, -(long) sl->size);
+			stat_add(&stat_large, -(long) sl->size);
+			munmap(sl, sl->size);
+		}
+		return;
+	}
+
+	opt_free_bin(ptr, sl);
+}
 
-	opt_free_bin(ptr);
+size_t opt_usable_size(void *ptr)
+{
+	slab *sl = slab_of(ptr);
+	if (sl->cls < 0) {
+		return (char *) sl + sl->size - (char *) ptr;
+	}
+	return class_size[sl->cls];
+}
+
+/**
+ * Grows a large block without copying it. The mapping is extended in place
+ * if the address space after it is free, and otherwise its pages are moved
+ * by mremap to a fresh slab-aligned range, so that slab_of still works.
+ * @param sl the block's span
+ * @param ptr the block
+ * @param bytes the new size of the block
+ * @return the grown block, or NULL if it could not be grown
+ */
+void *grow_large(slab *sl, void *ptr, size_t bytes)
+{
+	if (bytes > SIZE_MAX / 2) {
+		return NULL;
+	}
+	size_t offset = (char *) ptr - (char *) sl;
+	size_t total = large_round(offset + bytes);
+
+	size_t old = sl->size;
+	void *span = mremap(sl, old, total, 0);
+	if (span != MAP_FAILED) {
+		stat_add(&stat_mapped, total - old);
+	} else {
+		void *dest = map_aligned(total);
+		if (dest == NULL) {
+			return NULL;
+		}
+		span = mremap(sl, old, total, MREMAP_MAYMOVE|MREMAP_FIXED, dest);
+		if (span == MAP_FAILED) {
+			stat_add(&stat_mapped, -(long) total);
+			munmap(dest, total);
+			return NULL;
+		}
+		stat_add(&stat_mapped, -(long) old);
+	}
+	stat_add(&stat_large, total - old);
+	aren->large_taken += total - old;
+
+	sl = span;
+	sl->size = total;
+	sl->used = 1;
+	return (char *) sl + offset;
 }
 
 void *opt_realloc(void *prev, size_t size) {
-	header *hdr = prev - sizeof(header);
-	if (hdr->size >= size) {
+	if (prev == NULL) {
+		return opt_malloc(size);
+	}
+	if (aren == NULL && teardown_begin()) {
+		void *ptr = opt_realloc(prev, size);
+		teardown_end();
+		return ptr;
+	}
+	if (aren == NULL) {
+		init_arena();
+	}
+	slab *sl = slab_of(prev);
+	/* a sampled block is copied instead, as moving it would move its record */
+	if (sl->cls == LARGE_CLASS && size > opt_usable_size(prev)) {
+		void *grown = grow_large(sl, prev, size);
+		if (grown != NULL) {
+			return grown;
+		}
+	}
+	size_t old_size = opt_usable_size(prev);
+	if (old_size >= size) {
 		return prev;
 	}
 	void *new = opt_malloc(size);
-	memcpy(new, prev, hdr->size);
+	if (new == NULL) {
+		return NULL;
+	}
+	memcpy(new, prev, old_size);
 	opt_free(prev);
 	return new;
 }
+
+void opt_getstats(opt_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&arenas_lock);
+	arena *first = arenas;
+	pthread_mutex_unlock(&arenas_lock);
+
+	/* other threads' counters are read without a lock, so the sums are only
+	 * as consistent as a snapshot taken while they run can be */
+	size_t large_taken = 0, large_given = 0;
+	for (arena *a = first; a != NULL; a = a->next_arena) {
+		st->narenas++;
+		for (int bin = 0; bin < NUM_CLASSES; bin++) {
+			st->classes[bin].nmalloc += a->nmalloc[bin];
+			st->classes[bin].nfree += a->nfree[bin];
+			st->cached += (size_t) a->cache_count[bin] * class_size[bin];
+		}
+		st->large.nmalloc += a->large_nmalloc;
+		st->large.nfree += a->large_nfree;
+		large_taken += a->large_taken;
+		large_given += a->large_given;
+	}
+
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		opt_class_stats *cs = &st->classes[bin];
+		cs->size = class_size[bin];
+		cs->allocated = (cs->nmalloc - cs->nfree) * cs->size;
+		st->allocated += cs->allocated;
+		st->nmalloc += cs->nmalloc;
+		st->nfree += cs->nfree;
+
+		st->cached += (size_t) __atomic_load_n(&transfers[bin].count, __ATOMIC_RELAXED) *
+			class_size[bin];
+		for (int cpu = 0; percpu && cpu < ncpus; cpu++) {
+			size_t *count = (size_t *) (pcpu_base + cpu * pcpu_block + pcpu_off[bin]);
+			st->cached += *count * class_size[bin];
+		}
+	}
+
+	st->large.allocated = large_taken - large_given;
+	st->allocated += st->large.allocated;
+	st->nmalloc += st->large.nmalloc;
+	st->nfree += st->large.nfree;
+	st->cached += __atomic_load_n(&large_cached, __ATOMIC_RELAXED);
+
+	st->mapped = __atomic_load_n(&stat_mapped, __ATOMIC_RELAXED);
+	st->released = __atomic_load_n(&stat_released, __ATOMIC_RELAXED);
+	st->active = __atomic_load_n(&stat_slabs, __ATOMIC_RELAXED) - st->released +
+		__atomic_load_n(&stat_large, __ATOMIC_RELAXED);
+	st->fragmentation = st->active > 0 ? 1.0 - (double) st->allocated / st->active : 0;
+}
+
+void opt_printstats(void)
+{
+	opt_stats st;
+	opt_getstats(&st);
+
+	fprintf(stderr, "\n== opt malloc stats ==\n");
+	fprintf(stderr, "Allocated: %zu\n", st.allocated);
+	fprintf(stderr, "Active:    %zu\n", st.active);
+	fprintf(stderr, "Mapped:    %zu\n", st.mapped);
+	fprintf(stderr, "Released:  %zu\n", st.released);
+	fprintf(stderr, "Cached:    %zu\n", st.cached);
+	fprintf(stderr, "Frag:      %.3f\n", st.fragmentation);
+	fprintf(stderr, "Allocs:    %lu\n", st.nmalloc);
+	fprintf(stderr, "Frees:     %lu\n", st.nfree);
+	fprintf(stderr, "Arenas:    %u\n", st.narenas);
+	fprintf(stderr, "%8s %12s %12s %12s\n", "size", "allocs", "frees", "allocated");
+	for (int bin = 0; bin < NUM_CLASSES; bin++) {
+		opt_class_stats *cs = &st.classes[bin];
+		if (cs->nmalloc > 0) {
+			fprintf(stderr, "%8zu %12lu %12lu %12zu\n",
+				cs->size, cs->nmalloc, cs->nfree, cs->allocated);
+		}
+	}
+	fprintf(stderr, "%8s %12lu %12lu %12zu\n", "large",
+		st.large.nmalloc, st.large.nfree, st.large.allocated);
+}
+
+/**
+ * Copies a value out for opt_mallctl, checking the caller's buffer
+ * @return 0, or EINVAL if the buffer has the wrong size
+ */
+static int ctl_read(void *oldp, size_t *oldlenp, const void *value, size_t len)
+{
+	if (oldp == NULL || oldlenp == NULL) {
+		return 0;
+	}
+	if (*oldlenp != len) {
+		*oldlenp = len;
+		return EINVAL;
+	}
+	memcpy(oldp, value, len);
+	return 0;
+}
+
+int opt_mallctl(const char *name, void *oldp, size_t *oldlenp,
+		void *newp, size_t newlen)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+		size_t len;
+	} fields[] = {
+#define FIELD(n, f) { n, offsetof(opt_stats, f), sizeof(((opt_stats *) 0)->f) }
+		FIELD("stats.allocated", allocated),
+		FIELD("stats.active", active),
+		FIELD("stats.mapped", mapped),
+		FIELD("stats.released", released),
+		FIELD("stats.cached", cached),
+		FIELD("stats.fragmentation", fragmentation),
+		FIELD("stats.nmalloc", nmalloc),
+		FIELD("stats.nfree", nfree),
+		FIELD("stats.large.nmalloc", large.nmalloc),
+		FIELD("stats.large.nfree", large.nfree),
+		FIELD("stats.large.allocated", large.allocated),
+		FIELD("arenas.count", narenas),
+#undef FIELD
+	};
+
+	/* prof.dump writes a heap profile to the file newp points to the name
+	 * of, or to the next numbered one if that is NULL */
+	if (strcmp(name, "prof.dump") == 0) {
+		if (prof_rate == 0) {
+			return ENOENT;
+		}
+		if (oldp != NULL || (newp != NULL && newlen != sizeof(const char *))) {
+			return EINVAL;
+		}
+		return prof_dump(newp != NULL ? *(const char **) newp : NULL);
+	}
+
+	/* every other name is read-only */
+	if (newp != NULL || newlen != 0) {
+		return EPERM;
+	}
+
+	if (strcmp(name, "prof.rate") == 0) {
+		return ctl_read(oldp, oldlenp, &prof_rate, sizeof(prof_rate));
+	}
+	if (strcmp(name, "arenas.nclasses") == 0) {
+		unsigned nclasses = NUM_CLASSES;
+		return ctl_read(oldp, oldlenp, &nclasses, sizeof(nclasses));
+	}
+
+	opt_stats st;
+	opt_getstats(&st);
+
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (strcmp(name, fields[i].name) == 0) {
+			return ctl_read(oldp, oldlenp, (char *) &st + fields[i].offset,
+					fields[i].len);
+		}
+	}
+
+	/* stats.classes.<i>.size, .nmalloc, .nfree or .allocated */
+	int bin, end = 0;
+	char field[16];
+	if (sscanf(name, "stats.classes.%d.%15[a-z]%n", &bin, field, &end) == 2 &&
+	    name[end] == '\0' && bin >= 0 && bin < NUM_CLASSES) {
+		opt_class_stats *cs = &st.classes[bin];
+		if (strcmp(field, "size") == 0) {
+			return ctl_read(oldp, oldlenp, &cs->size, sizeof(cs->size));
+		}
+		if (strcmp(field, "nmalloc") == 0) {
+			return ctl_read(oldp, oldlenp, &cs->nmalloc, sizeof(cs->nmalloc));
+		}
+		if (strcmp(field, "nfree") == 0) {
+			return ctl_read(oldp, oldlenp, &cs->nfree, sizeof(cs->nfree));
+		}
+		if (strcmp(field, "allocated") == 0) {
+			return ctl_read(oldp, oldlenp, &cs->allocated, sizeof(cs->allocated));
+		}
+	}
+
+	return ENOENT;
+}
@@ -1,17 +1,62 @@
 #ifndef OPT_MALLOC_H
 #define OPT_MALLOC_H
 
+#include <stddef.h>
+
+#include "size_classes.h"
+
+/* A free small block; allocated blocks carry no header at all. */
 typedef struct node_t {
 	struct node_t *next;
-	size_t size;
 } node;
 
-typedef struct header_t {
-	size_t size;
-} header;
-
 void *opt_malloc(size_t bytes);
 void opt_free(void *ptr);
 void *opt_realloc(void *prev, size_t bytes);
+/* align is a power of two; NULL if memory runs out */
+void *opt_memalign(size_t align, size_t bytes);
+size_t opt_usable_size(void *ptr);
+
+typedef struct opt_class_stats {
+	size_t size;
+	unsigned long nmalloc;
+	unsigned long nfree;
+	size_t allocated;	/* bytes in live blocks */
+} opt_class_stats;
+
+typedef struct opt_stats {
+	size_t allocated;	/* bytes in live blocks, small and large */
+	size_t active;		/* bytes of resident slabs and large spans */
+	size_t mapped;		/* bytes mapped from the OS, metadata included */
+	size_t released;	/* slab bytes handed back with madvise */
+	size_t cached;		/* bytes of free blocks in caches, large spans included */
+	double fragmentation;	/* share of active bytes not allocated */
+	unsigned long nmalloc;
+	unsigned long nfree;
+	unsigned narenas;
+	opt_class_stats classes[NUM_CLASSES];
+	struct {
+		unsigned long nmalloc;
+		unsigned long nfree;
+		size_t allocated;
+	} large;
+} opt_stats;
+
+/* Sums the counters of every arena. */
+void opt_getstats(opt_stats *st);
+void opt_printstats(void);
+
+/*
+ * Reads one statistic by name, in the manner of jemalloc's mallctl: *oldlenp
+ * must be the size of the value's type. Names are those of opt_stats with a
+ * "stats." prefix (stats.large.nmalloc, stats.classes.3.nfree, ...), plus
+ * arenas.count, arenas.nclasses and prof.rate (0 when profiling is off). Only
+ * prof.dump takes newp, a pointer to the name of the file to write a heap
+ * profile to, or to NULL for the next numbered one. Returns 0, ENOENT for an
+ * unknown name, EINVAL for a wrong length, EPERM if newp is given to any other
+ * name, or the errno of a failed dump.
+ */
+int opt_mallctl(const char *name, void *oldp, size_t *oldlenp,
+		void *newp, size_t newlen);
 
-#endif
\ No newline at end of file
+#endif
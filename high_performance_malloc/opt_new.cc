@@ -0,0 +1,140 @@
+/*
+ * C++ operator new and delete on top of opt_malloc, for libopt_malloc.so.
+ * The throwing forms call the new handler and retry until it gives up.
+ */
+#include <cstddef>
+#include <new>
+
+extern "C" {
+#include "opt_malloc.h"
+}
+
+#define EXPORT __attribute__((visibility("default")))
+
+static void *alloc(std::size_t bytes, std::size_t align)
+{
+	for (;;) {
+		void *ptr = align == 0 ? opt_malloc(bytes) : opt_memalign(align, bytes);
+		if (ptr != nullptr) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void *alloc_nothrow(std::size_t bytes, std::size_t align) noexcept
+{
+	try {
+		return alloc(bytes, align);
+	} catch (...) {
+		return nullptr;
+	}
+}
+
+EXPORT void *operator new(std::size_t bytes)
+{
+	return alloc(bytes, 0);
+}
+
+EXPORT void *operator new[](std::size_t bytes)
+{
+	return alloc(bytes, 0);
+}
+
+EXPORT void *operator new(std::size_t bytes, const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(bytes, 0);
+}
+
+EXPORT void *operator new[](std::size_t bytes, const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(bytes, 0);
+}
+
+EXPORT void *operator new(std::size_t bytes, std::align_val_t align)
+{
+	return alloc(bytes, static_cast<std::size_t>(align));
+}
+
+EXPORT void *operator new[](std::size_t bytes, std::align_val_t align)
+{
+	return alloc(bytes, static_cast<std::size_t>(align));
+}
+
+EXPORT void *operator new(std::size_t bytes, std::align_val_t align,
+			  const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(bytes, static_cast<std::size_t>(align));
+}
+
+EXPORT void *operator new[](std::size_t bytes, std::align_val_t align,
+			    const std::nothrow_t &) noexcept
+{
+	return alloc_nothrow(bytes, static_cast<std::size_t>(align));
+}
+
+EXPORT void operator delete(void *ptr) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete[](void *ptr) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete(void *ptr, std::size_t) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete[](void *ptr, std::size_t) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete(void *ptr, std::align_val_t) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete(void *ptr, std::align_val_t,
+			    const std::nothrow_t &) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete[](void *ptr, std::align_val_t,
+			      const std::nothrow_t &) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept
+{
+	opt_free(ptr);
+}
+
+EXPORT void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept
+{
+	opt_free(ptr);
+}
@@ -0,0 +1,113 @@
+/*
+ * The standard allocation functions on top of opt_malloc, for building
+ * libopt_malloc.so. Preloading it replaces the allocator of an unmodified
+ * program:
+ *
+ *   LD_PRELOAD=./libopt_malloc.so program
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "opt_malloc.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static int is_pow2(size_t x)
+{
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+static void *check(void *ptr)
+{
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+EXPORT void *malloc(size_t bytes)
+{
+	return check(opt_malloc(bytes));
+}
+
+EXPORT void free(void *ptr)
+{
+	opt_free(ptr);
+}
+
+EXPORT void *calloc(size_t count, size_t size)
+{
+	size_t bytes;
+	if (__builtin_mul_overflow(count, size, &bytes)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *ptr = check(opt_malloc(bytes));
+	if (ptr != NULL) {
+		memset(ptr, 0, bytes);
+	}
+	return ptr;
+}
+
+EXPORT void *realloc(void *prev, size_t bytes)
+{
+	if (prev != NULL && bytes == 0) {
+		opt_free(prev);
+		return NULL;
+	}
+	return check(opt_realloc(prev, bytes));
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t bytes)
+{
+	if (!is_pow2(align) || align % sizeof(void *) != 0) {
+		return EINVAL;
+	}
+
+	void *ptr = opt_memalign(align, bytes);
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t bytes)
+{
+	if (!is_pow2(align)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return check(opt_memalign(align, bytes));
+}
+
+EXPORT void *memalign(size_t align, size_t bytes)
+{
+	return aligned_alloc(align, bytes);
+}
+
+EXPORT void *valloc(size_t bytes)
+{
+	return check(opt_memalign(sysconf(_SC_PAGESIZE), bytes));
+}
+
+EXPORT void *pvalloc(size_t bytes)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return check(opt_memalign(page, (bytes + page - 1) & ~(page - 1)));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+	return ptr != NULL ? opt_usable_size(ptr) : 0;
+}
+
+EXPORT int mallctl(const char *name, void *oldp, size_t *oldlenp,
+		   void *newp, size_t newlen)
+{
+	return opt_mallctl(name, oldp, oldlenp, newp, newlen);
+}
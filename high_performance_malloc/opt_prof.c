@@ -0,0 +1,439 @@
+/*
+ * The sampling heap profiler of opt_malloc. Setting OPT_MALLOC_PROF to a path
+ * prefix turns it on: about one allocation per OPT_MALLOC_PROF_RATE bytes is
+ * sampled along with its call stack, and the samples still live are written
+ * out as a pprof heap profile on OPT_MALLOC_PROF_SIGNAL (SIGUSR2 by default)
+ * and at exit, to <prefix>.<pid>.<seq>.heap.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "opt_prof.h"
+
+#define DEFAULT_RATE (512 << 10)
+
+size_t prof_rate;
+
+static const char *prof_prefix;
+static int prof_seq;
+/* the signal handler wakes the dump thread through this pipe */
+static int prof_pipe[2] = { -1, -1 };
+
+/* sampled blocks not yet freed, most recent first */
+static prof_sample *live;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bytes this thread may allocate before its next sample */
+static __thread long sample_left;
+static __thread uint64_t prng;
+/* set while the profiler itself allocates, which is never sampled */
+static __thread int in_prof;
+/* bounds of this thread's stack, which the unwinder stays within */
+static __thread uintptr_t stack_lo;
+static __thread uintptr_t stack_hi;
+
+/**
+ * Draws the number of bytes until the next sample from an exponential
+ * distribution with mean prof_rate, which makes the samples a Poisson process
+ * over allocated bytes: every byte is equally likely to be sampled, however
+ * the allocations that contain it are sized.
+ * @return the distance, at least 1
+ */
+static long next_distance(void)
+{
+	/* xorshift64* */
+	prng ^= prng >> 12;
+	prng ^= prng << 25;
+	prng ^= prng >> 27;
+	uint64_t r = prng * 0x2545f4914f6cdd1dULL;
+
+	double u = ((r >> 11) + 1) * 0x1p-53;
+	return (long) (-log(u) * prof_rate) + 1;
+}
+
+/**
+ * Counts an allocation against this thread's sampling distance
+ * @param bytes size of the allocation
+ * @return whether to sample it
+ */
+int prof_should_sample(size_t bytes)
+{
+	sample_left -= (long) bytes;
+	if (sample_left > 0) {
+		return 0;
+	}
+
+	/* a thread's first allocation only draws its first distance */
+	if (prng == 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		prng = ((uintptr_t) &prng ^ (uint64_t) ts.tv_nsec << 20 ^ ts.tv_sec) | 1;
+		sample_left = next_distance();
+		return 0;
+	}
+
+	sample_left = next_distance();
+	return !in_prof;
+}
+
+/**
+ * Finds the bounds of this thread's stack, or leaves them empty if they are
+ * unknown. pthread_getattr_np allocates, which in_prof keeps from sampling.
+ */
+static void find_stack(void)
+{
+	pthread_attr_t attr;
+	void *addr;
+	size_t size;
+
+	stack_lo = stack_hi = 1;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+		return;
+	}
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+		stack_lo = (uintptr_t) addr;
+		stack_hi = (uintptr_t) addr + size;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Walks the chain of frame pointers: each frame starts with the caller's frame
+ * pointer, followed by the return address. The walk ends at a frame that is
+ * not further up this thread's stack, so a function built without frame
+ * pointers cuts the stack short but cannot make the walk fault.
+ * @param stack where to store the return addresses, innermost first
+ * @param max most addresses to store
+ * @return the number stored
+ */
+static int __attribute__((noinline)) unwind(void **stack, int max)
+{
+	uintptr_t *fp = __builtin_frame_address(0);
+	int depth = 0;
+
+	while (depth < max) {
+		uintptr_t *next = (uintptr_t *) fp[0];
+		if (next <= fp || (uintptr_t) next < stack_lo ||
+		    (uintptr_t) (next + 2) > stack_hi || ((uintptr_t) next & 7) != 0) {
+			break;
+		}
+		if (next[1] == 0) {
+			break;
+		}
+		stack[depth++] = (void *) next[1];
+		fp = next;
+	}
+	return depth;
+}
+
+/**
+ * Records a sampled allocation and links it into the live samples
+ * @param s the record, in the block's span
+ * @param bytes size of the allocation
+ */
+void prof_record(prof_sample *s, size_t bytes)
+{
+	in_prof = 1;
+	if (stack_hi == 0) {
+		find_stack();
+	}
+	s->bytes = bytes;
+	/* the walk starts with prof_record's own return address */
+	s->depth = unwind(s->stack, PROF_DEPTH);
+	if (s->depth == 0) {
+		s->stack[0] = __builtin_return_address(0);
+		s->depth = 1;
+	}
+	in_prof = 0;
+
+	pthread_mutex_lock(&prof_lock);
+	s->prev = NULL;
+	s->next = live;
+	if (live != NULL) {
+		live->prev = s;
+	}
+	live = s;
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/**
+ * Unlinks the record of a sampled block being freed
+ * @param s the record
+ */
+void prof_forget(prof_sample *s)
+{
+	pthread_mutex_lock(&prof_lock);
+	if (s->prev != NULL) {
+		s->prev->next = s->next;
+	} else {
+		live = s->next;
+	}
+	if (s->next != NULL) {
+		s->next->prev = s->prev;
+	}
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/**
+ * Orders samples by call stack, so that samples of one stack are adjacent
+ */
+static int stack_cmp(const prof_sample *a, const prof_sample *b)
+{
+	if (a->depth != b->depth) {
+		return a->depth < b->depth ? -1 : 1;
+	}
+	return memcmp(a->stack, b->stack, a->depth * sizeof(a->stack[0]));
+}
+
+/**
+ * Heapsorts samples by stack_cmp; qsort may call malloc, which would deadlock
+ * on prof_lock if it sampled
+ * @param v the samples
+ * @param n how many
+ */
+static void sort_samples(prof_sample **v, size_t n)
+{
+	for (size_t start = n / 2, end = n; end > 1;) {
+		if (start > 0) {
+			start--;
+		} else {
+			end--;
+			prof_sample *t = v[0];
+			v[0] = v[end];
+			v[end] = t;
+		}
+		size_t root = start;
+		for (size_t child; (child = 2 * root + 1) < end; root = child) {
+			if (child + 1 < end && stack_cmp(v[child], v[child + 1]) < 0) {
+				child++;
+			}
+			if (stack_cmp(v[root], v[child]) >= 0) {
+				break;
+			}
+			prof_sample *t = v[root];
+			v[root] = v[child];
+			v[child] = t;
+		}
+	}
+}
+
+/* A buffered writer that allocates nothing. */
+typedef struct out_t {
+	int fd;
+	int err;
+	size_t len;
+	char buf[4096];
+} out;
+
+static void out_flush(out *o)
+{
+	size_t done = 0;
+	while (done < o->len && o->err == 0) {
+		ssize_t n = write(o->fd, o->buf + done, o->len - done);
+		if (n < 0 && errno != EINTR) {
+			o->err = errno;
+		} else if (n > 0) {
+			done += n;
+		}
+	}
+	o->len = 0;
+}
+
+static void out_printf(out *o, const char *fmt, ...)
+{
+	if (o->len > sizeof(o->buf) - 256) {
+		out_flush(o);
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	o->len += vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * Writes the live samples in the text format of gperftools' heap profiles,
+ * which pprof reads: a header with the totals and the sampling rate, which
+ * pprof uses to scale the samples up, one line per call stack, and the
+ * process's mappings to symbolize the addresses with. Only memory in use is
+ * profiled, so the allocation totals are zero.
+ * @param path file to write, or NULL for the next <prefix>.<pid>.<seq>.heap
+ * @return 0, or an errno value
+ */
+int prof_dump(const char *path)
+{
+	char name[4096];
+	if (path == NULL) {
+		snprintf(name, sizeof(name), "%s.%d.%04d.heap", prof_prefix, (int) getpid(),
+			 __atomic_fetch_add(&prof_seq, 1, __ATOMIC_RELAXED));
+		path = name;
+	}
+
+	out o = { .fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644) };
+	if (o.fd < 0) {
+		return errno;
+	}
+
+	pthread_mutex_lock(&prof_lock);
+	size_t n = 0, bytes = 0;
+	for (prof_sample *s = live; s != NULL; s = s->next) {
+		n++;
+		bytes += s->bytes;
+	}
+
+	prof_sample **v = NULL;
+	size_t vlen = (n * sizeof(*v) + 4095) & ~(size_t) 4095;
+	if (n > 0) {
+		v = mmap(NULL, vlen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (v == MAP_FAILED) {
+			pthread_mutex_unlock(&prof_lock);
+			close(o.fd);
+			return ENOMEM;
+		}
+		size_t i = 0;
+		for (prof_sample *s = live; s != NULL; s = s->next) {
+			v[i++] = s;
+		}
+		sort_samples(v, n);
+	}
+
+	out_printf(&o, "heap profile: %6zu: %8zu [%6d: %8d] @ heap_v2/%zu\n",
+		   n, bytes, 0, 0, prof_rate);
+	for (size_t i = 0; i < n;) {
+		size_t j = i, group = 0;
+		for (; j < n && stack_cmp(v[i], v[j]) == 0; j++) {
+			group += v[j]->bytes;
+		}
+		out_printf(&o, "%6zu: %8zu [%6d: %8d] @", j - i, group, 0, 0);
+		for (int k = 0; k < v[i]->depth; k++) {
+			out_printf(&o, " %p", v[i]->stack[k]);
+		}
+		out_printf(&o, "\n");
+		i = j;
+	}
+	pthread_mutex_unlock(&prof_lock);
+	if (v != NULL) {
+		munmap(v, vlen);
+	}
+
+	out_printf(&o, "\nMAPPED_LIBRARIES:\n");
+	int maps = open("/proc/self/maps", O_RDONLY|O_CLOEXEC);
+	if (maps >= 0) {
+		out_flush(&o);
+		ssize_t got;
+		while ((got = read(maps, o.buf, sizeof(o.buf))) > 0) {
+			o.len = got;
+			out_flush(&o);
+		}
+		close(maps);
+	}
+	out_flush(&o);
+
+	if (close(o.fd) != 0 && o.err == 0) {
+		o.err = errno;
+	}
+	return o.err;
+}
+
+/**
+ * Handler of the profiling signal. Dumping takes a lock, so it is left to the
+ * dump thread.
+ */
+static void on_signal(int sig)
+{
+	(void) sig;
+	int saved = errno;
+	if (prof_pipe[1] >= 0) {
+		ssize_t ignored = write(prof_pipe[1], "", 1);
+		(void) ignored;
+	}
+	errno = saved;
+}
+
+/**
+ * The dump thread: writes a profile each time the signal arrives
+ */
+static void *dump_thread(void *arg)
+{
+	(void) arg;
+	char c;
+	for (;;) {
+		ssize_t n = read(prof_pipe[0], &c, 1);
+		if (n == 1) {
+			prof_dump(NULL);
+		} else if (n == 0 || errno != EINTR) {
+			return NULL;
+		}
+	}
+}
+
+static void dump_at_exit(void)
+{
+	prof_dump(NULL);
+}
+
+/**
+ * Reads the OPT_MALLOC_PROF variables and, if profiling is on, starts the
+ * dump thread and installs the signal handler. Sampling begins only once
+ * prof_rate is set, last.
+ */
+void prof_init(void)
+{
+	prof_prefix = getenv("OPT_MALLOC_PROF");
+	if (prof_prefix == NULL || *prof_prefix == '\0') {
+		return;
+	}
+
+	char *env = getenv("OPT_MALLOC_PROF_RATE");
+	size_t rate = env != NULL ? strtoul(env, NULL, 10) : DEFAULT_RATE;
+	env = getenv("OPT_MALLOC_PROF_SIGNAL");
+	int sig = env != NULL ? atoi(env) : SIGUSR2;
+
+	if (sig > 0 && pipe2(prof_pipe, O_CLOEXEC) == 0) {
+		fcntl(prof_pipe[1], F_SETFL, O_NONBLOCK);
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, dump_thread, NULL) == 0) {
+			pthread_detach(thread);
+			struct sigaction sa = { .sa_handler = on_signal, .sa_flags = SA_RESTART };
+			sigemptyset(&sa.sa_mask);
+			sigaction(sig, &sa, NULL);
+		}
+	}
+	atexit(dump_at_exit);
+
+	prof_rate = rate > 0 ? rate : 1;
+}
+
+void prof_fork_prepare(void)
+{
+	pthread_mutex_lock(&prof_lock);
+}
+
+void prof_fork_parent(void)
+{
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/* The dump thread did not survive the fork, so the child dumps only at exit. */
+void prof_fork_child(void)
+{
+	pthread_mutex_init(&prof_lock, NULL);
+	if (prof_pipe[0] >= 0) {
+		int w = prof_pipe[1];
+		prof_pipe[1] = -1;
+		close(w);
+		close(prof_pipe[0]);
+		prof_pipe[0] = -1;
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef OPT_PROF_H
+#define OPT_PROF_H
+
+#include <stddef.h>
+
+/* return addresses kept per sample */
+#define PROF_DEPTH 30
+
+/*
+ * A sampled allocation. opt_malloc gives every sampled block a span of its
+ * own and keeps this record in the span, between the header and the block,
+ * so it lives exactly as long as the block.
+ */
+typedef struct prof_sample_t {
+	struct prof_sample_t *next;
+	struct prof_sample_t *prev;
+	size_t bytes;
+	int depth;
+	void *stack[PROF_DEPTH];
+} prof_sample;
+
+/* mean bytes allocated between samples, or 0 when profiling is off */
+extern size_t prof_rate;
+
+void prof_init(void);
+int prof_should_sample(size_t bytes);
+void prof_record(prof_sample *s, size_t bytes);
+void prof_forget(prof_sample *s);
+int prof_dump(const char *path);
+
+void prof_fork_prepare(void);
+void prof_fork_parent(void);
+void prof_fork_child(void);
+
+#endif
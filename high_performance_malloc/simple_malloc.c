@@ -16,7 +16,8 @@ void xfree(void *ptr)
 void *xrealloc(void *prev, size_t bytes)
 {
 	void *ret_val = xmalloc(bytes);
-	memcpy(ret_val, prev, bytes);
+	size_t old = husable_size(prev);
+	memcpy(ret_val, prev, old < bytes ? old : bytes);
 	xfree(prev);
 	return ret_val;
 }
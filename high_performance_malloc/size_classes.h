@@ -0,0 +1,74 @@
+/* Generated by gen_size_classes.pl; do not edit. */
+#ifndef SIZE_CLASSES_H
+#define SIZE_CLASSES_H
+
+#include <stddef.h>
+
+#define NUM_CLASSES 38
+#define CLASS_GRANULE 16
+#define MAX_SMALL_SIZE 4096
+#define MAX_BATCH 32
+#define CACHE_SLOTS 7724
+
+/* Bytes handed out for each class. */
+static const unsigned short class_size[NUM_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	144, 160, 176, 192, 208, 224, 256, 288,
+	320, 352, 400, 448, 512, 576, 656, 736,
+	832, 944, 1072, 1216, 1376, 1568, 1792, 2048,
+	2336, 2656, 3024, 3456, 3936, 4096,
+};
+
+/* Blocks moved at once between a thread cache and the transfer cache. */
+static const unsigned char class_batch[NUM_CLASSES] = {
+	32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 28,
+	25, 23, 20, 18, 16, 14, 12, 11, 9, 8, 7, 6, 5, 5, 4, 4,
+	3, 3, 2, 2, 2, 2,
+};
+
+/* Most blocks of each class a thread cache holds. */
+static const unsigned short class_cache_max[NUM_CLASSES] = {
+	2048, 1024, 682, 512, 409, 341, 292, 256, 227, 204, 186, 170, 157, 146, 128, 113,
+	102, 93, 81, 73, 64, 56, 49, 44, 39, 34, 30, 26, 23, 20, 18, 16,
+	14, 12, 10, 9, 8, 8,
+};
+
+/* Where each class's array starts among a thread's CACHE_SLOTS. */
+static const unsigned short class_cache_off[NUM_CLASSES] = {
+	0, 2048, 3072, 3754, 4266, 4675, 5016, 5308, 5564, 5791, 5995, 6181, 6351, 6508, 6654, 6782,
+	6895, 6997, 7090, 7171, 7244, 7308, 7364, 7413, 7457, 7496, 7530, 7560, 7586, 7609, 7629, 7647,
+	7663, 7677, 7689, 7699, 7708, 7716,
+};
+
+/* Class of a request, indexed by its size in granules, rounded up. */
+static const unsigned char class_of_granule[257] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	14, 15, 15, 16, 16, 17, 17, 18, 18, 18, 19, 19, 19, 20, 20, 20,
+	20, 21, 21, 21, 21, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 24,
+	24, 24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 26, 26, 26, 26,
+	26, 26, 26, 26, 27, 27, 27, 27, 27, 27, 27, 27, 27, 28, 28, 28,
+	28, 28, 28, 28, 28, 28, 28, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	29, 29, 29, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+	30, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31, 31,
+	31, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+	32, 32, 32, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33, 33,
+	33, 33, 33, 33, 33, 33, 33, 34, 34, 34, 34, 34, 34, 34, 34, 34,
+	34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 35, 35,
+	35, 35, 35, 35, 35, 35, 35, 35, 35, 35, 35, 35, 35, 35, 35, 35,
+	35, 35, 35, 35, 35, 35, 35, 35, 35, 36, 36, 36, 36, 36, 36, 36,
+	36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36,
+	36, 36, 36, 36, 36, 36, 36, 37, 37, 37, 37, 37, 37, 37, 37, 37,
+	37,
+};
+
+/**
+ * Finds the size class of a small request in constant time
+ * @param bytes request size, at most MAX_SMALL_SIZE
+ * @return index into class_size
+ */
+static inline int size_class(size_t bytes)
+{
+	return class_of_granule[(bytes + CLASS_GRANULE - 1) / CLASS_GRANULE];
+}
+
+#endif